@@ -1,12 +1,34 @@
 /* error.h
  * Error handling for pngnq 
+ *
+ * libpngnq builds the quantizer with PNGNQ_QUIET defined: a library
+ * reports through its return codes, and must not write to the stderr or
+ * the syslog of the program that embeds it.
  */
+#ifndef PNGNQ_QUIET
 #include "syslog.h"
+#endif
 
 /* Error codes */
 #define PNGNQ_ERR_NONE 0
 #define PNGNQ_ERR_ 0
 
+/* Stream that messages are printed to. pngnq redirects this per thread
+   when processing several files at once. */
+#ifndef PNGNQ_MSGOUT
+#define PNGNQ_MSGOUT stderr
+#endif
+
+#ifdef PNGNQ_QUIET
+
+#define PNGNQ_LOG_ERR(...)
+#define PNGNQ_LOG_WARNING(...)
+#define PNGNQ_ERROR(...) do { } while (0)
+#define PNGNQ_WARNING(...) do { } while (0)
+#define PNGNQ_MESSAGE(...) do { } while (0)
+
+#else
+
 #define PNGNQ_LOG_ERR(...)(syslog(LOG_ERR,\
     "pngnq - Error in %s near line %d:",__FILE__,__LINE__));\
     syslog(LOG_ERR, __VA_ARGS__); 
@@ -14,17 +36,19 @@
 #define PNGNQ_LOG_WARNING(...)(syslog(LOG_WARNING,"pngnq - warning: "));\
     syslog(LOG_WARNING, __VA_ARGS__);
 
-#define PNGNQ_ERROR(...) (fprintf(stderr,\
+#define PNGNQ_ERROR(...) (fprintf(PNGNQ_MSGOUT,\
     "pngnq - Error in %s near line %d :\n",__FILE__,__LINE__));\
-    fprintf(stderr, __VA_ARGS__);\
+    fprintf(PNGNQ_MSGOUT, __VA_ARGS__);\
     PNGNQ_LOG_ERR(__VA_ARGS__)\
-    fflush(stderr);
+    fflush(PNGNQ_MSGOUT);
 
 #define PNGNQ_WARNING(...)                                \
     do {                                                  \
-        fprintf(stderr, "pngnq - Warning: " __VA_ARGS__); \
+        fprintf(PNGNQ_MSGOUT, "pngnq - Warning: " __VA_ARGS__); \
         PNGNQ_LOG_WARNING(__VA_ARGS__)                    \
-        fflush(stderr);                                   \
+        fflush(PNGNQ_MSGOUT);                             \
     } while (0)
 
-#define PNGNQ_MESSAGE(...) {if(verbose) {fprintf(stderr,__VA_ARGS__);fflush(stderr);}}
+#define PNGNQ_MESSAGE(...) {if(verbose) {fprintf(PNGNQ_MSGOUT,__VA_ARGS__);fflush(PNGNQ_MSGOUT);}}
+
+#endif
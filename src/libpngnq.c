@@ -0,0 +1,134 @@
+/* libpngnq.c - the library interface to the pngnq quantizer, see pngnq.h
+**
+** Copyright (C) 2004-2009 by Stuart Coyle
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted, provided
+** that the above copyright notice appear in all copies and that both that
+** copyright notice and this permission notice appear in supporting
+** documentation.  This software is provided "as is" without express or
+** implied warranty.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "png.h"
+#include "neuquant32.h"
+#include "rwpng.h"
+#include "quantize.h"
+#include "pngnq.h"
+
+struct pngnq_context {
+  uch **row_pointers;		/* into the indices being written */
+  unsigned int rows_alloc;	/* entries allocated for row_pointers */
+};
+
+const char *pngnq_version(void)
+{
+  return VERSION;
+}
+
+void pngnq_options_init(pngnq_options *options)
+{
+  memset(options, 0, sizeof(*options));
+  options->colours = 256;
+  options->gamma = 1.8;
+  options->dither = PNGNQ_DITHER_NONE;
+  options->precision = PNGNQ_PRECISION_DOUBLE;
+  options->search = PNGNQ_SEARCH_BRUTE;
+  options->threads = 1;
+  options->order = PNGNQ_ORDER_NONE;
+}
+
+pngnq_context *pngnq_create(void)
+{
+  return (pngnq_context *)calloc(1, sizeof(pngnq_context));
+}
+
+void pngnq_destroy(pngnq_context *ctx)
+{
+  if (ctx) {
+    free(ctx->row_pointers);
+    free(ctx);
+  }
+}
+
+int pngnq_quantize(pngnq_context *ctx, const unsigned char *rgba,
+                   unsigned int width, unsigned int height,
+                   const pngnq_options *options,
+                   pngnq_palette *palette, unsigned char *indices)
+{
+  static const int precisions[] = { NQ_PRECISION_DOUBLE, NQ_PRECISION_FLOAT, NQ_PRECISION_FIXED };
+  static const int searches[] = { NQ_SEARCH_BRUTE, NQ_SEARCH_KDTREE, NQ_SEARCH_NETINDEX };
+  static const int methods[] = { QUANT_NONE, QUANT_FLOYD, QUANT_ORDERED };
+  static const int orders[] = { ORDER_NONE, ORDER_LUMINANCE, ORDER_NEIGHBOURS };
+  pngnq_options defaults;
+  mainprog_info info;
+  exact_palette exact;
+  nq_context *nq = NULL;
+  unsigned char map[MAXNETSIZE][4];
+  unsigned int remap[MAXNETSIZE];
+  unsigned int n_colours, num_trans, row, x;
+  size_t n_pixels = (size_t)width * height;
+  int use_exact, retval;
+
+  if (!options) {
+    pngnq_options_init(&defaults);
+    options = &defaults;
+  }
+  if (!ctx || !rgba || !palette || !indices || n_pixels == 0 ||
+      options->colours < 1 || options->colours > MAXNETSIZE ||
+      options->speed > 10 || options->gamma <= 0 ||
+      (unsigned int)options->dither > PNGNQ_DITHER_ORDERED ||
+      (unsigned int)options->precision > PNGNQ_PRECISION_FIXED ||
+      (unsigned int)options->search > PNGNQ_SEARCH_NETINDEX ||
+      (unsigned int)options->order > PNGNQ_ORDER_NEIGHBOURS)
+    return PNGNQ_ERR_ARGUMENT;
+
+  /* pixels go straight into indices, a row at a time */
+  if (height > ctx->rows_alloc) {
+    uch **row_pointers = (uch **)realloc(ctx->row_pointers, height * sizeof(uch *));
+    if (!row_pointers)
+      return PNGNQ_ERR_MEMORY;
+    ctx->row_pointers = row_pointers;
+    ctx->rows_alloc = height;
+  }
+  for (row = 0; row < height; row++)
+    ctx->row_pointers[row] = indices + (size_t)row * width;
+
+  use_exact = find_exact_palette(&exact, rgba, 4, n_pixels, options->colours);
+  retval = quantize_palette(rgba, NULL, n_pixels, 4, use_exact ? &exact : NULL,
+                            options->colours, options->speed, options->gamma,
+                            precisions[options->precision], searches[options->search], 0, &nq,
+                            map, remap, &n_colours, &num_trans);
+  if (retval)
+    return retval;
+  if (orders[options->order] == ORDER_LUMINANCE)
+    order_by_luminance(map, n_colours, num_trans, remap);
+
+  memset(&info, 0, sizeof(info));
+  info.width = width;
+  info.height = height;
+  info.rgba_data = (uch *)rgba;		/* only read */
+  info.channels = 4;
+  info.sample_depth = 8;		/* a byte per index */
+  retval = quantize_remap(&info, nq, use_exact ? &exact : NULL, width, height, map,
+                          n_colours, remap, ctx->row_pointers, methods[options->dither],
+                          options->threads, 0);
+  nq_destroy(nq);
+  if (!retval && orders[options->order] == ORDER_NEIGHBOURS)
+    retval = order_by_neighbours(ctx->row_pointers, width, height, n_colours, num_trans, remap);
+  if (retval)
+    return retval;
+
+  memset(palette, 0, sizeof(*palette));
+  palette->count = n_colours;
+  palette->num_trans = num_trans;
+  for (x = 0; x < n_colours; x++)
+    memcpy(palette->rgba[remap[x]], map[x], 4);
+  return PNGNQ_OK;
+}
@@ -27,8 +27,15 @@
 
 
 #include "neuquant32.h"
+#include <stdlib.h>
 #include <math.h>
 
+/* the contest() functions have SSE2 and AVX versions, picked at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define NQ_X86_SIMD 1
+#  include <immintrin.h>
+#endif
+
 
 /* 
     Network Definitions
@@ -53,7 +60,6 @@
 /* defs for decreasing alpha factor */
 #define alphabiasshift  10              /* alpha starts at 1.0 */
 #define initalpha   ((double)(1<<alphabiasshift))
-double alphadec;                        /* biased by 10 bits */
 
 /* radbias and alpharadbias used for radpower calculation */
 #define radbiasshift    8
@@ -61,74 +67,207 @@ double alphadec;                        /* biased by 10 bits */
 #define alpharadbshift  (alphabiasshift+radbiasshift)
 #define alpharadbias    ((double)(1<<alpharadbshift))
 
+/* defs for NQ_PRECISION_FIXED, which works like Dekker's original integer
+   code: colours scaled by 1<<netbiasshift, bias and freq by 1<<intbiasshift */
+#define netbiasshift    4
+#define intbiasshift    16
+#define intbias         (1<<intbiasshift)
+#define intbeta         (intbias>>betashift)
+#define intbetagamma    (intbias<<(gammashift-betashift))
+
+/* learn() trains on a histogram of the distinct colours instead of on raw
+   pixels when the image has few of them */
+#define histrounds      20              /* presentations of each distinct colour */
+#define histminsamples  (128*MAXNETSIZE) /* but never fewer samples than this in total */
+#define histmaxbits     18              /* at most 1<<histmaxbits distinct colours */
+
 
 /* 
-    Types and Global Variables
+    Types and Quantizer Context
 */
-   
-static unsigned char *thepicture;      /* the input image itself */
-static unsigned int lengthcount;        /* lengthcount = H*W*4 */
 
-typedef struct                          /* ABGRc */
+typedef struct                          /* ABGRc, one array per channel */
 {               
-    double al,b,g,r;
-} nq_pixel;
+    double al[MAXNETSIZE];              /* so that contest() can compare */
+    double b[MAXNETSIZE];               /* several neurons at once */
+    double g[MAXNETSIZE];
+    double r[MAXNETSIZE];
+} nq_network;
 
-static nq_pixel network[MAXNETSIZE];    /* the network itself */
+typedef struct                          /* training state for NQ_PRECISION_FLOAT */
+{
+    float al[MAXNETSIZE];
+    float b[MAXNETSIZE];
+    float g[MAXNETSIZE];
+    float r[MAXNETSIZE];
+    float bias[MAXNETSIZE];
+    float freq[MAXNETSIZE];
+} nq_float_network;
 
-static unsigned int netindex[256];      /* for network lookup - really 256 */
+typedef struct                          /* training state for NQ_PRECISION_FIXED */
+{
+    int al[MAXNETSIZE];                 /* colours << netbiasshift */
+    int b[MAXNETSIZE];
+    int g[MAXNETSIZE];
+    int r[MAXNETSIZE];
+    int bias[MAXNETSIZE];               /* bias and freq << intbiasshift */
+    int freq[MAXNETSIZE];
+} nq_fixed_network;
 
-static double bias [MAXNETSIZE];        /* bias and freq arrays for learning */
-static double freq [MAXNETSIZE];
-static double radpower[initrad];        /* radpower for precomputation */
+typedef struct 
+{
+    unsigned char r,g,b,al;  
+} nq_colormap;
 
-static unsigned int netsize;            /* Number of colours to use. */
+typedef struct                          /* k-d tree node, see kdbuild() */
+{
+    unsigned char c[4];                 /* al,r,g,b of the colormap entry */
+    unsigned char axis;                 /* index into c[] this node splits on */
+    unsigned char entry;                /* index into colormap[] */
+} nq_kdnode;
 
-static double gamma_correction;         /* 1.0/2.2 usually */
+typedef struct
+{
+    unsigned int rgba;                  /* packed pixel, red in the low byte */
+    size_t count;                       /* number of pixels, 0 for an empty slot */
+} nq_histitem;
 
-static double biasvalues[256];          /* Biasvalues: based on frequency of nearest pixels */
+typedef int nq_contest_fn(nq_context *nq, double al, double b, double g, double r);
+typedef int nq_contest_float_fn(nq_context *nq, float al, float b, float g, float r);
+typedef int nq_contest_fixed_fn(nq_context *nq, int al, int b, int g, int r);
+typedef unsigned int nq_brute_fn(const nq_context *nq, float al, float r, float g, float b, float colimp, unsigned char *cand);
+
+/* All state of one quantization run lives here, so that several images
+   can be trained and remapped at the same time (one context each). */
+struct nq_context
+{
+    unsigned char *thepicture;          /* the input image itself */
+    size_t lengthcount;                 /* lengthcount = H*W*channels */
+    unsigned int channels;              /* bytes per pixel: gray, gray+alpha, RGB or RGBA */
+    const signed char *thefraction;     /* 256ths of a level each byte of it is off by, or NULL */
+
+    nq_network network;                 /* the network itself */
+    nq_colormap colormap[MAXNETSIZE];   /* unbiased network, built by inxbuild() */
+
+    unsigned int netindex[256];         /* for network lookup - really 256 */
+    nq_kdnode kdtree[MAXNETSIZE];       /* balanced k-d tree of the colormap */
+    unsigned int transparent;           /* best match for fully transparent pixels */
+    float pal_al[MAXNETSIZE];           /* colormap as floats, one array per channel, */
+    float pal_r[MAXNETSIZE];            /* for the exhaustive SIMD search; padded to */
+    float pal_g[MAXNETSIZE];            /* palsize entries that never match */
+    float pal_b[MAXNETSIZE];
+    unsigned int palsize;
+    int search;                         /* inxsearch() method, NQ_SEARCH_* */
+
+    double bias [MAXNETSIZE];           /* bias and freq arrays for learning */
+    double freq [MAXNETSIZE];
+    double radpower[initrad+1];         /* radpower for precomputation (+1: alterneigh() reads radpower[rad]) */
+    double wradpower[initrad+1];        /* radpower scaled by the weight of a histogram entry */
+
+    unsigned int netsize;               /* Number of colours to use. */
+    double alphadec;                    /* biased by 10 bits */
+
+    double gamma_correction;            /* 1.0/2.2 usually */
+
+    double biasvalues[256];             /* Biasvalues: based on frequency of nearest pixels */
+
+    int precision;                      /* arithmetic used by learn(), NQ_PRECISION_* */
+    nq_float_network fnet;              /* copies of network, bias and freq */
+    nq_fixed_network inet;              /* used while learning in lower precision */
+
+    nq_contest_fn *contest;             /* fastest contest() this CPU can run */
+    nq_contest_float_fn *contest_float;
+    nq_contest_fixed_fn *contest_fixed;
+    nq_brute_fn *brute;                 /* fastest bruteinxsearch() kernel */
+};
+
+static inline double biasvalue(const nq_context *nq, unsigned int temp);
+static void select_kernels(nq_context *nq);
+static void kdbuild(nq_context *nq, unsigned int lo, unsigned int hi);
+
+/* Allocate a zeroed quantizer context; returns NULL when out of memory */
+nq_context *nq_create(void)
+{
+    nq_context *nq = (nq_context *)calloc(1, sizeof(nq_context));
+    if (nq) {
+        select_kernels(nq);
+        nq->channels = 4;
+    }
+    return nq;
+}
+
+/* Set the layout of the picture given to initnet(), 4 (RGBA) by default */
+void nq_set_channels(nq_context *nq, unsigned int channels)
+{
+    nq->channels = channels;
+}
+
+/* Set what each byte of the picture is off by, for pictures rounded from
+   more than 8 bits; NULL (the default) if nothing */
+void nq_set_fraction(nq_context *nq, const signed char *fraction)
+{
+    nq->thefraction = fraction;
+}
+
+/* Choose the arithmetic learn() uses, NQ_PRECISION_DOUBLE by default */
+void nq_set_precision(nq_context *nq, int precision)
+{
+    nq->precision = precision;
+}
+
+/* Choose how inxsearch() looks up colours, NQ_SEARCH_NETINDEX by default */
+void nq_set_search(nq_context *nq, int search)
+{
+    nq->search = search;
+}
+
+/* Release a context obtained from nq_create() */
+void nq_destroy(nq_context *nq)
+{
+    free(nq);
+}
 
 /* 
     Initialise network in range (0,0,0,0) to (255,255,255,255) and set parameters
 */
-void initnet(unsigned char *thepic,unsigned int len,unsigned int colours, double gamma_c)
+void initnet(nq_context *nq, unsigned char *thepic,size_t len,unsigned int colours, double gamma_c)
 {
     unsigned int i;
     
-    gamma_correction = gamma_c;
+    nq->gamma_correction = gamma_c;
     
     /* Clear out network from previous runs */
     /* thanks to Chen Bin for this fix */
-    memset((void*)network,0,sizeof(network));
+    memset((void*)&nq->network,0,sizeof(nq->network));
 
-    thepicture = thepic;
-    lengthcount = len;
-    netsize = colours; 
+    nq->thepicture = thepic;
+    nq->lengthcount = len;
+    nq->netsize = colours; 
     
     for(i=0;i<256;i++)
     {
         double temp;
-        temp = pow(i/255.0, 1.0/gamma_correction) * 255.0;
+        temp = pow(i/255.0, 1.0/nq->gamma_correction) * 255.0;
         temp = round(temp);
-        biasvalues[i] = temp;
+        nq->biasvalues[i] = temp;
     }
     
-    for (i=0; i<netsize; i++) {
-        network[i].b = network[i].g = network[i].r = biasvalue(i*256/netsize);
+    for (i=0; i<nq->netsize; i++) {
+        nq->network.b[i] = nq->network.g[i] = nq->network.r[i] = biasvalue(nq, i*256/nq->netsize);
               
         /*  Sets alpha values at 0 for dark pixels. */
-        if (i < 16) network[i].al = (i*16); else network[i].al = 255; 
+        if (i < 16) nq->network.al[i] = (i*16); else nq->network.al[i] = 255; 
         
-        freq[i] = 1.0/netsize;  /* 1/netsize */
-        bias[i] = 0;
+        nq->freq[i] = 1.0/nq->netsize;  /* 1/netsize */
+        nq->bias[i] = 0;
     }
 }
 
-static unsigned int unbiasvalue(double temp)
+static unsigned int unbiasvalue(const nq_context *nq, double temp)
 {
     if (temp < 0) return 0;
     
-    temp = pow(temp/255.0, gamma_correction) * 255.0;    
+    temp = pow(temp/255.0, nq->gamma_correction) * 255.0;    
     temp = floor((temp / 255.0 * 256.0));
 
     if (temp > 255) return 255;
@@ -145,21 +284,32 @@ static inline unsigned int round_biased(double temp)
 }
 
 
-inline static double biasvalue(unsigned int temp)
+inline static double biasvalue(const nq_context *nq, unsigned int temp)
 {    
-    return biasvalues[temp];
+    return nq->biasvalues[temp];
+}
+
+/* biasvalue() of temp + frac/256, frac -128..127, between those of the
+   levels either side */
+static inline double biasfraction(const nq_context *nq, unsigned int temp, int frac)
+{
+    if (frac > 0 && temp < 255)
+        return nq->biasvalues[temp] + (nq->biasvalues[temp+1] - nq->biasvalues[temp]) * frac / 256.0;
+    if (frac < 0 && temp > 0)
+        return nq->biasvalues[temp] + (nq->biasvalues[temp] - nq->biasvalues[temp-1]) * frac / 256.0;
+    return nq->biasvalues[temp];
 }
 
 /* Output colormap to unsigned char ptr in RGBA format */
-void getcolormap(unsigned char *map)
+void getcolormap(const nq_context *nq, unsigned char *map)
 {
     unsigned int j;
-    for(j=0; j<netsize; j++)
+    for(j=0; j<nq->netsize; j++)
     {
-        *map++ = unbiasvalue(network[j].r);
-        *map++ = unbiasvalue(network[j].g);
-        *map++ = unbiasvalue(network[j].b);
-        *map++ = round_biased(network[j].al);
+        *map++ = unbiasvalue(nq, nq->network.r[j]);
+        *map++ = unbiasvalue(nq, nq->network.g[j]);
+        *map++ = unbiasvalue(nq, nq->network.b[j]);
+        *map++ = round_biased(nq->network.al[j]);
     }
 }
 
@@ -167,53 +317,119 @@ void getcolormap(unsigned char *map)
 /* Insertion sort of network and building of netindex[0..255] (to do after unbias)
    ------------------------------------------------------------------------------- */
 
-typedef struct 
-{
-    unsigned char r,g,b,al;  
-} nq_colormap;
-
-static nq_colormap colormap[256];
-
-void inxbuild()
+void inxbuild(nq_context *nq)
 {
     unsigned int i,j,smallpos,smallval;
     unsigned int previouscol,startpos;
 
-    for(i=0; i< netsize; i++)
+    for(i=0; i< nq->netsize; i++)
     {
-        colormap[i].r =  biasvalue(unbiasvalue(network[i].r));
-        colormap[i].g =  biasvalue(unbiasvalue(network[i].g));
-        colormap[i].b =  biasvalue(unbiasvalue(network[i].b));
-        colormap[i].al = round_biased(network[i].al);        
+        nq->colormap[i].r =  biasvalue(nq, unbiasvalue(nq, nq->network.r[i]));
+        nq->colormap[i].g =  biasvalue(nq, unbiasvalue(nq, nq->network.g[i]));
+        nq->colormap[i].b =  biasvalue(nq, unbiasvalue(nq, nq->network.b[i]));
+        nq->colormap[i].al = round_biased(nq->network.al[i]);        
     }
         
     previouscol = 0;
     startpos = 0;
-    for (i=0; i<netsize; i++) {
+    for (i=0; i<nq->netsize; i++) {
         smallpos = i;
-        smallval = (colormap[i].g);         /* index on g */
+        smallval = (nq->colormap[i].g);         /* index on g */
         /* find smallest in i..netsize-1 */
-        for (j=i+1; j<netsize; j++) {
-            if ((colormap[j].g) < smallval) {       /* index on g */
+        for (j=i+1; j<nq->netsize; j++) {
+            if ((nq->colormap[j].g) < smallval) {       /* index on g */
                 smallpos = j;
-                smallval = (colormap[j].g); /* index on g */
+                smallval = (nq->colormap[j].g); /* index on g */
             }
         }
         /* swap colormap[i] (i) and colormap[smallpos] (smallpos) entries */
         if (i != smallpos) {
-            nq_pixel temp = network[smallpos];   network[smallpos] = network[i];   network[i] = temp;
-            nq_colormap tempc = colormap[smallpos];   colormap[smallpos] = colormap[i];   colormap[i] = tempc;
+            double temp;
+            temp = nq->network.al[smallpos];   nq->network.al[smallpos] = nq->network.al[i];   nq->network.al[i] = temp;
+            temp = nq->network.b[smallpos];   nq->network.b[smallpos] = nq->network.b[i];   nq->network.b[i] = temp;
+            temp = nq->network.g[smallpos];   nq->network.g[smallpos] = nq->network.g[i];   nq->network.g[i] = temp;
+            temp = nq->network.r[smallpos];   nq->network.r[smallpos] = nq->network.r[i];   nq->network.r[i] = temp;
+            nq_colormap tempc = nq->colormap[smallpos];   nq->colormap[smallpos] = nq->colormap[i];   nq->colormap[i] = tempc;
         }
         /* smallval entry is now in position i */
         if (smallval != previouscol) {
-            netindex[previouscol] = (startpos+i)>>1;
-            for (j=previouscol+1; j<smallval; j++) netindex[j] = i;
+            nq->netindex[previouscol] = (startpos+i)>>1;
+            for (j=previouscol+1; j<smallval; j++) nq->netindex[j] = i;
             previouscol = smallval;
             startpos = i;
         }
     }
-    netindex[previouscol] = (startpos+maxnetpos)>>1;
-    for (j=previouscol+1; j<256; j++) netindex[j] = maxnetpos; /* really 256 */
+    nq->netindex[previouscol] = (startpos+maxnetpos)>>1;
+    for (j=previouscol+1; j<256; j++) nq->netindex[j] = maxnetpos; /* really 256 */
+
+    /* colour does not matter for fully transparent pixels, only alpha */
+    nq->transparent = 0;
+    for (i=0; i<nq->netsize; i++) {
+        nq->kdtree[i].c[0] = nq->colormap[i].al;
+        nq->kdtree[i].c[1] = nq->colormap[i].r;
+        nq->kdtree[i].c[2] = nq->colormap[i].g;
+        nq->kdtree[i].c[3] = nq->colormap[i].b;
+        nq->kdtree[i].entry = i;
+        if (nq->colormap[i].al < nq->colormap[nq->transparent].al) nq->transparent = i;
+    }
+    kdbuild(nq,0,nq->netsize);
+
+    nq->palsize = (nq->netsize+7) & ~7u;
+    for (i=0; i<nq->palsize; i++) {
+        if (i < nq->netsize) {
+            nq->pal_al[i] = nq->colormap[i].al;
+            nq->pal_r[i] = nq->colormap[i].r;
+            nq->pal_g[i] = nq->colormap[i].g;
+            nq->pal_b[i] = nq->colormap[i].b;
+        } else {
+            nq->pal_al[i] = 1e6f;       /* too far away to ever be chosen */
+            nq->pal_r[i] = nq->pal_g[i] = nq->pal_b[i] = 0;
+        }
+    }
+}
+
+
+/* Build the k-d tree over kdtree[lo..hi-1]. The tree is implicit: the median
+   of a range is its root, with the lower half to its left and the upper half
+   to its right. Each node splits on the axis with the greatest spread.
+   ------------------------------------------------------------------------- */
+
+static void kdbuild(nq_context *nq, unsigned int lo, unsigned int hi)
+{
+    unsigned int i,j,k,axis,spread,mid;
+    unsigned char min[4],max[4];
+    nq_kdnode t;
+
+    if (hi <= lo) return;
+
+    for (k=0; k<4; k++) min[k] = max[k] = nq->kdtree[lo].c[k];
+    for (i=lo+1; i<hi; i++) {
+        for (k=0; k<4; k++) {
+            if (nq->kdtree[i].c[k] < min[k]) min[k] = nq->kdtree[i].c[k];
+            if (nq->kdtree[i].c[k] > max[k]) max[k] = nq->kdtree[i].c[k];
+        }
+    }
+    axis = 0;
+    spread = max[0]-min[0];
+    for (k=1; k<4; k++) {
+        if ((unsigned int)(max[k]-min[k]) > spread) {
+            axis = k;
+            spread = max[k]-min[k];
+        }
+    }
+
+    /* insertion sort on the axis; ranges are at most MAXNETSIZE long */
+    for (i=lo+1; i<hi; i++) {
+        t = nq->kdtree[i];
+        for (j=i; j>lo && nq->kdtree[j-1].c[axis] > t.c[axis]; j--)
+            nq->kdtree[j] = nq->kdtree[j-1];
+        nq->kdtree[j] = t;
+    }
+
+    mid = (lo+hi)/2;
+    nq->kdtree[mid].axis = axis;
+    kdbuild(nq,lo,mid);
+    kdbuild(nq,mid+1,hi);
 }
 
         
@@ -226,74 +442,287 @@ inline static double colorimportance(double al)
 /* Search for ABGR values 0..255 (after net is unbiased) and return colour index
    ---------------------------------------------------------------------------- */
 
-unsigned int slowinxsearch( int al, int b, int g, int r)
+/* Distance between colormap entry i and biased (al,r,g,b), the same for
+   all the searches below
+   ---------------------------------------------------------------------- */
+static inline double colormapdist(const nq_context *nq, unsigned int i, int al, int r, int g, int b, double colimp)
+{
+    double a,dist;
+
+    a = nq->colormap[i].r - r;
+    dist = a*a * colimp;
+
+    a = nq->colormap[i].g - g;
+    dist += a*a * colimp;
+
+    a = nq->colormap[i].b - b;
+    dist += a*a * colimp;
+
+    a = nq->colormap[i].al - al;
+    dist += a*a;
+    return dist;
+}
+
+unsigned int slowinxsearch(const nq_context *nq, int al, int b, int g, int r)
 {
     unsigned int i,best=0;
-    double a,bestd=1<<30,dist;
+    double bestd=1<<30,dist;
     
-    r=biasvalue(r);
-    g=biasvalue(g);
-    b=biasvalue(b);
+    r=biasvalue(nq, r);
+    g=biasvalue(nq, g);
+    b=biasvalue(nq, b);
    
     double colimp = colorimportance(al);
     
-    for(i=0; i < netsize; i++)
+    for(i=0; i < nq->netsize; i++)
     {
-        a = colormap[i].r - r;
-        dist = a*a * colimp;
-
-        a = colormap[i].g - g;
-        dist += a*a * colimp;
-        
-        a = colormap[i].b - b;
-        dist += a*a * colimp;
-        
-        a = colormap[i].al - al;
-        dist += a*a;
-        
+        dist = colormapdist(nq,i,al,r,g,b,colimp);
         if (dist<bestd) {bestd=dist; best=i;}        
     }
     return best;
 }
 
-unsigned int inxsearch( int al, int b, int g, int r)
+/* Nearest neighbour search in kdtree[lo..hi-1]. Distances are computed
+   exactly as in slowinxsearch(), and ties go to the lowest colormap index,
+   so both always agree.
+   ---------------------------------------------------------------------- */
+
+#define kdbucket    6                   /* ranges this small are just scanned */
+
+static inline void kdvisit(const nq_kdnode *n, const int *q, double colimp, unsigned int *best, double *bestd)
+{
+    double a,dist;
+
+    a = n->c[1] - q[1];
+    dist = a*a * colimp;
+    a = n->c[2] - q[2];
+    dist += a*a * colimp;
+    a = n->c[3] - q[3];
+    dist += a*a * colimp;
+    a = n->c[0] - q[0];
+    dist += a*a;
+    if (dist < *bestd || (dist == *bestd && n->entry < *best)) {
+        *bestd = dist;
+        *best = n->entry;
+    }
+}
+
+static void kdsearch(const nq_context *nq, const int *q, double colimp,
+                     unsigned int lo, unsigned int hi, unsigned int *best, double *bestd)
+{
+    unsigned int mid;
+    const nq_kdnode *n;
+    double a,planedist;
+
+    while (hi-lo > kdbucket) {
+        mid = (lo+hi)/2;
+        n = &nq->kdtree[mid];
+        kdvisit(n,q,colimp,best,bestd);
+
+        a = q[n->axis] - n->c[n->axis];
+        planedist = n->axis ? a*a * colimp : a*a;
+        if (a < 0) {                    /* nearer half first, then the other if it can still win */
+            kdsearch(nq,q,colimp,lo,mid,best,bestd);
+            if (planedist > *bestd) return;
+            lo = mid+1;
+        } else {
+            kdsearch(nq,q,colimp,mid+1,hi,best,bestd);
+            if (planedist > *bestd) return;
+            hi = mid;
+        }
+    }
+    for (; lo<hi; lo++) kdvisit(&nq->kdtree[lo],q,colimp,best,bestd);
+}
+
+static unsigned int kdinxsearch(const nq_context *nq, int al, int b, int g, int r)
+{
+    unsigned int best = 0;
+    double bestd = 1<<30;
+    int q[4];
+
+    if (!al) return nq->transparent;
+
+    q[0] = al;
+    q[1] = biasvalue(nq, r);
+    q[2] = biasvalue(nq, g);
+    q[3] = biasvalue(nq, b);
+    kdsearch(nq,q,colorimportance(al),0,nq->netsize,&best,&bestd);
+    return best;
+}
+
+/* Exhaustive search: a SIMD kernel computes the distance to every entry in
+   single precision without branches and picks out the few entries within
+   rounding error of the nearest one. These are then compared exactly as
+   in slowinxsearch().
+   ----------------------------------------------------------------------- */
+
+#define bruteslack  0.25f               /* well above the float rounding error of
+                                           distances up to 4*255*255 */
+
+static unsigned int brute_scalar(const nq_context *nq, float al, float r, float g, float b, float colimp, unsigned char *cand)
+{
+    float dist[MAXNETSIZE];
+    unsigned int i,n;
+    float a,d,limit = 1e30f;
+
+    for (i=0; i<nq->palsize; i++)
+    {
+        a = nq->pal_r[i] - r;
+        d = a*a;
+        a = nq->pal_g[i] - g;
+        d += a*a;
+        a = nq->pal_b[i] - b;
+        d += a*a;
+        a = nq->pal_al[i] - al;
+        d = d*colimp + a*a;
+        dist[i] = d;
+        if (d < limit) limit = d;
+    }
+    limit += bruteslack;
+
+    for (i=0, n=0; i<nq->palsize; i++)
+        if (dist[i] <= limit) cand[n++] = i;
+    return n;
+}
+
+#ifdef NQ_X86_SIMD
+
+/* Four entries per step */
+__attribute__((target("sse2")))
+static unsigned int brute_sse2(const nq_context *nq, float al, float r, float g, float b, float colimp, unsigned char *cand)
+{
+    const __m128 vr = _mm_set1_ps(r), vg = _mm_set1_ps(g), vb = _mm_set1_ps(b);
+    const __m128 val = _mm_set1_ps(al), vc = _mm_set1_ps(colimp);
+    __m128 dist[MAXNETSIZE/4];
+    __m128 best = _mm_set1_ps(1e30f);
+    __m128 a,d;
+    unsigned int i,n,mask;
+
+    for (i=0; i<nq->palsize; i+=4)
+    {
+        a = _mm_sub_ps(_mm_loadu_ps(nq->pal_r + i), vr);
+        d = _mm_mul_ps(a, a);
+        a = _mm_sub_ps(_mm_loadu_ps(nq->pal_g + i), vg);
+        d = _mm_add_ps(d, _mm_mul_ps(a, a));
+        a = _mm_sub_ps(_mm_loadu_ps(nq->pal_b + i), vb);
+        d = _mm_add_ps(d, _mm_mul_ps(a, a));
+        a = _mm_sub_ps(_mm_loadu_ps(nq->pal_al + i), val);
+        d = _mm_add_ps(_mm_mul_ps(d, vc), _mm_mul_ps(a, a));
+        dist[i/4] = d;
+        best = _mm_min_ps(best, d);
+    }
+    best = _mm_min_ps(best, _mm_movehl_ps(best, best));
+    best = _mm_min_ps(best, _mm_shuffle_ps(best, best, 0x55));
+    best = _mm_add_ps(_mm_shuffle_ps(best, best, 0), _mm_set1_ps(bruteslack));
+
+    for (i=0, n=0; i<nq->palsize; i+=4) {
+        mask = _mm_movemask_ps(_mm_cmple_ps(dist[i/4], best));
+        for (; mask; mask &= mask-1) cand[n++] = i + __builtin_ctz(mask);
+    }
+    return n;
+}
+
+/* Eight entries per step */
+__attribute__((target("avx")))
+static unsigned int brute_avx(const nq_context *nq, float al, float r, float g, float b, float colimp, unsigned char *cand)
+{
+    const __m256 vr = _mm256_set1_ps(r), vg = _mm256_set1_ps(g), vb = _mm256_set1_ps(b);
+    const __m256 val = _mm256_set1_ps(al), vc = _mm256_set1_ps(colimp);
+    __m256 dist[MAXNETSIZE/8];
+    __m256 best = _mm256_set1_ps(1e30f);
+    __m256 a,d;
+    unsigned int i,n,mask;
+
+    for (i=0; i<nq->palsize; i+=8)
+    {
+        a = _mm256_sub_ps(_mm256_loadu_ps(nq->pal_r + i), vr);
+        d = _mm256_mul_ps(a, a);
+        a = _mm256_sub_ps(_mm256_loadu_ps(nq->pal_g + i), vg);
+        d = _mm256_add_ps(d, _mm256_mul_ps(a, a));
+        a = _mm256_sub_ps(_mm256_loadu_ps(nq->pal_b + i), vb);
+        d = _mm256_add_ps(d, _mm256_mul_ps(a, a));
+        a = _mm256_sub_ps(_mm256_loadu_ps(nq->pal_al + i), val);
+        d = _mm256_add_ps(_mm256_mul_ps(d, vc), _mm256_mul_ps(a, a));
+        dist[i/8] = d;
+        best = _mm256_min_ps(best, d);
+    }
+    best = _mm256_min_ps(best, _mm256_permute2f128_ps(best, best, 1));
+    best = _mm256_min_ps(best, _mm256_permute_ps(best, 0x4e));
+    best = _mm256_min_ps(best, _mm256_permute_ps(best, 0xb1));
+    best = _mm256_add_ps(best, _mm256_set1_ps(bruteslack));
+
+    for (i=0, n=0; i<nq->palsize; i+=8) {
+        mask = _mm256_movemask_ps(_mm256_cmp_ps(dist[i/8], best, _CMP_LE_OQ));
+        for (; mask; mask &= mask-1) cand[n++] = i + __builtin_ctz(mask);
+    }
+    return n;
+}
+
+#endif /* NQ_X86_SIMD */
+
+static unsigned int bruteinxsearch(const nq_context *nq, int al, int b, int g, int r)
+{
+    unsigned char cand[MAXNETSIZE];
+    double colimp,d,bestd = 1<<30;
+    unsigned int i,n,best = 0;
+
+    if (!al) return nq->transparent;
+
+    r = biasvalue(nq, r);
+    g = biasvalue(nq, g);
+    b = biasvalue(nq, b);
+    colimp = colorimportance(al);
+
+    n = nq->brute(nq,al,r,g,b,colimp,cand);
+    if (n == 1) return cand[0];
+    for (i=0; i<n; i++) {               /* candidates come in index order */
+        d = colormapdist(nq,cand[i],al,r,g,b,colimp);
+        if (d < bestd) {bestd = d; best = cand[i];}
+    }
+    return best;
+}
+
+unsigned int inxsearch(const nq_context *nq, int al, int b, int g, int r)
 {
     unsigned int i; int j; double dist,a,bestd;
     unsigned int best;
         
+    if (nq->search == NQ_SEARCH_KDTREE) return kdinxsearch(nq,al,b,g,r);
+    if (nq->search == NQ_SEARCH_BRUTE) return bruteinxsearch(nq,al,b,g,r);
+
     bestd = 1<<30;      /* biggest possible dist */
     best = 0;
  
     if (al)
     {       
-        r=biasvalue(r);
-        g=biasvalue(g);
-        b=biasvalue(b);
+        r=biasvalue(nq, r);
+        g=biasvalue(nq, g);
+        b=biasvalue(nq, b);
     }
     else
     {
         r=g=b=0;
     }
 
-    i = netindex[(g)];  /* index on g */
+    i = nq->netindex[(g)];  /* index on g */
     j = i-1;        /* start at netindex[g] and work outwards */
 
 
     double colimp = colorimportance(al);
 
-    while ((i<netsize) || (j>=0)) {
-        if (i<netsize) {
-            a = colormap[i].g - g;      /* inx key */
+    while ((i<nq->netsize) || (j>=0)) {
+        if (i<nq->netsize) {
+            a = nq->colormap[i].g - g;      /* inx key */
             dist = a*a * colimp;
             if (dist > bestd) break;    /* stop iter */
             else {
-                a = colormap[i].r - r;
+                a = nq->colormap[i].r - r;
                 dist += a*a * colimp;
                 if (dist<bestd) {
-                    a = colormap[i].b - b;
+                    a = nq->colormap[i].b - b;
                     dist += a*a * colimp;
                     if(dist<bestd) {
-                        a = colormap[i].al - al;
+                        a = nq->colormap[i].al - al;
                         dist += a*a;
                         if (dist<bestd) {bestd=dist; best=i;}
                     }
@@ -302,17 +731,17 @@ unsigned int inxsearch( int al, int b, int g, int r)
             }
         }
         if (j>=0) {
-            a = colormap[j].g - g; /* inx key - reverse dif */
+            a = nq->colormap[j].g - g; /* inx key - reverse dif */
             dist = a*a * colimp;
             if (dist > bestd) break; /* stop iter */
             else {
-                a = colormap[j].b - b;
+                a = nq->colormap[j].b - b;
                 dist += a*a * colimp;
                 if (dist<bestd) {
-                    a = colormap[j].r - r;
+                    a = nq->colormap[j].r - r;
                     dist += a*a * colimp;
                     if(dist<bestd) {
-                        a = colormap[j].al - al;
+                        a = nq->colormap[j].al - al;
                         dist += a*a;
                         if (dist<bestd) {bestd=dist; best=j;}
                     }
@@ -330,14 +759,18 @@ unsigned int inxsearch( int al, int b, int g, int r)
 /* Search for biased ABGR values
    ---------------------------- */
 
-int contest(double al,double b,double g,double r)
-{
-    /* finds closest neuron (min dist) and updates freq */
-    /* finds best neuron (min dist-bias) and returns position */
-    /* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
-    /* bias[i] = gamma*((1/netsize)-freq[i]) */
+/* finds closest neuron (min dist) and updates freq */
+/* finds best neuron (min dist-bias) and returns position */
+/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
+/* bias[i] = gamma*((1/netsize)-freq[i]) */
+
+/* The scalar and SIMD versions below do the same arithmetic in the same
+   order and break ties towards the lowest index, so they pick identical
+   neurons and leave freq[] and bias[] bit-for-bit identical. */
 
-    unsigned int i; double dist,a,betafreq;
+static int contest_scalar(nq_context *nq, double al,double b,double g,double r)
+{
+    unsigned int i; double dist,biasdist,a,betafreq;
     unsigned int bestpos,bestbiaspos;double bestd,bestbiasd;
     
     bestd = 1<<30;
@@ -348,65 +781,635 @@ int contest(double al,double b,double g,double r)
     /* Using colorimportance(al) here was causing problems with images that were close to monocolor.
        See bug reports: 3149791, 2938728, 2896731 and 2938710
     */ 
-    double colimp = 1.0; //colorimportance(al); 
     
-    for (i=0; i<netsize; i++)
+    for (i=0; i<nq->netsize; i++)
     {
-        double bestbiasd_biased = bestbiasd + bias[i];
-        
-        a = network[i].b - b;
-        dist = ABS(a) * colimp;
-        a = network[i].r - r;
-        dist += ABS(a) * colimp;
+        a = nq->network.b[i] - b;
+        dist = ABS(a);
+        a = nq->network.r[i] - r;
+        dist += ABS(a);
         
-        if (dist < bestd || dist < bestbiasd_biased)
+        /* the remaining terms can only make dist larger */
+        if (dist < bestd || dist - nq->bias[i] < bestbiasd)
         {                 
-            a = network[i].g - g;
-            dist += ABS(a) * colimp;
-            a = network[i].al - al;
+            a = nq->network.g[i] - g;
+            dist += ABS(a);
+            a = nq->network.al[i] - al;
             dist += ABS(a);
             
+            biasdist = dist - nq->bias[i];
             if (dist<bestd) {bestd=dist; bestpos=i;}
-            if (dist<bestbiasd_biased) {bestbiasd=dist - bias[i]; bestbiaspos=i;}
+            if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
         }
-        betafreq = freq[i] / (1<< betashift);
-        freq[i] -= betafreq;
-        bias[i] += betafreq * (1<<gammashift);
+        betafreq = nq->freq[i] / (1<< betashift);
+        nq->freq[i] -= betafreq;
+        nq->bias[i] += betafreq * (1<<gammashift);
+    }
+    nq->freq[bestpos] += beta;
+    nq->bias[bestpos] -= betagamma;
+    return(bestbiaspos);
+}
+
+
+/* The same search in single precision and in fixed point. These follow the
+   double version step for step, so again every CPU gets the same result
+   (as long as float arithmetic is done in single precision, as with SSE). */
+
+static int contest_float_scalar(nq_context *nq, float al,float b,float g,float r)
+{
+    nq_float_network *n = &nq->fnet;
+    unsigned int i; float dist,biasdist,betafreq;
+    unsigned int bestpos,bestbiaspos;float bestd,bestbiasd;
+
+    bestd = 1<<30;
+    bestbiasd = bestd;
+    bestpos = 0;
+    bestbiaspos = bestpos;
+
+    for (i=0; i<nq->netsize; i++)
+    {
+        dist = fabsf(n->b[i] - b);
+        dist += fabsf(n->r[i] - r);
+        dist += fabsf(n->g[i] - g);
+        dist += fabsf(n->al[i] - al);
+
+        biasdist = dist - n->bias[i];
+        if (dist<bestd) {bestd=dist; bestpos=i;}
+        if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
+
+        betafreq = n->freq[i] / (1<< betashift);
+        n->freq[i] -= betafreq;
+        n->bias[i] += betafreq * (1<<gammashift);
     }
-    freq[bestpos] += beta;
-    bias[bestpos] -= betagamma;
+    n->freq[bestpos] += (float)beta;
+    n->bias[bestpos] -= (float)betagamma;
     return(bestbiaspos);
 }
 
+static int contest_fixed_scalar(nq_context *nq, int al,int b,int g,int r)
+{
+    nq_fixed_network *n = &nq->inet;
+    unsigned int i; int dist,biasdist,a,betafreq;
+    unsigned int bestpos,bestbiaspos;int bestd,bestbiasd;
+
+    bestd = 1<<30;
+    bestbiasd = bestd;
+    bestpos = 0;
+    bestbiaspos = bestpos;
+
+    for (i=0; i<nq->netsize; i++)
+    {
+        a = n->b[i] - b;
+        dist = ABS(a);
+        a = n->r[i] - r;
+        dist += ABS(a);
+        a = n->g[i] - g;
+        dist += ABS(a);
+        a = n->al[i] - al;
+        dist += ABS(a);
+
+        biasdist = dist - (n->bias[i] >> (intbiasshift-netbiasshift));
+        if (dist<bestd) {bestd=dist; bestpos=i;}
+        if (biasdist<bestbiasd) {bestbiasd=biasdist; bestbiaspos=i;}
+
+        betafreq = n->freq[i] >> betashift;
+        n->freq[i] -= betafreq;
+        n->bias[i] += betafreq << gammashift;
+    }
+    n->freq[bestpos] += intbeta;
+    n->bias[bestpos] -= intbetagamma;
+    return(bestbiaspos);
+}
+
+#ifdef NQ_X86_SIMD
+
+/* Combine the per-lane winners of a SIMD contest: lowest distance wins,
+   lowest neuron index on ties, as in the sequential scan */
+static inline void reduce_lanes(const double *d, const double *pos, int lanes,
+                                double *bestd, unsigned int *bestpos)
+{
+    int k;
+    for (k=0; k<lanes; k++) {
+        if (d[k] < *bestd || (d[k] == *bestd && pos[k] < *bestpos)) {
+            *bestd = d[k];
+            *bestpos = pos[k];
+        }
+    }
+}
+
+/* Sequential scan of neurons from..netsize-1, continuing a SIMD contest */
+static inline void contest_tail(nq_context *nq, unsigned int from,
+                                double al, double b, double g, double r,
+                                double *bestd, unsigned int *bestpos,
+                                double *bestbiasd, unsigned int *bestbiaspos)
+{
+    unsigned int i; double dist,biasdist,a,betafreq;
+
+    for (i=from; i<nq->netsize; i++)
+    {
+        a = nq->network.b[i] - b;
+        dist = ABS(a);
+        a = nq->network.r[i] - r;
+        dist += ABS(a);
+        a = nq->network.g[i] - g;
+        dist += ABS(a);
+        a = nq->network.al[i] - al;
+        dist += ABS(a);
+
+        biasdist = dist - nq->bias[i];
+        if (dist<*bestd) {*bestd=dist; *bestpos=i;}
+        if (biasdist<*bestbiasd) {*bestbiasd=biasdist; *bestbiaspos=i;}
+
+        betafreq = nq->freq[i] / (1<< betashift);
+        nq->freq[i] -= betafreq;
+        nq->bias[i] += betafreq * (1<<gammashift);
+    }
+}
+
+/* Two neurons per step */
+__attribute__((target("sse2")))
+static int contest_sse2(nq_context *nq, double al,double b,double g,double r)
+{
+    const __m128d signbit = _mm_set1_pd(-0.0);
+    const __m128d vb = _mm_set1_pd(b), vr = _mm_set1_pd(r);
+    const __m128d vg = _mm_set1_pd(g), val = _mm_set1_pd(al);
+    const __m128d betadiv = _mm_set1_pd(1<< betashift);
+    const __m128d gammamul = _mm_set1_pd(1<<gammashift);
+    const __m128d two = _mm_set1_pd(2.0);
+    __m128d pos = _mm_set_pd(1.0, 0.0);
+    __m128d bestd_v = _mm_set1_pd(1<<30), bestpos_v = _mm_setzero_pd();
+    __m128d bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    double d[2], p[2];
+    double bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, n = nq->netsize & ~1u;
+
+    for (i=0; i<n; i+=2)
+    {
+        __m128d dist, biasdist, freq, bias, betafreq, m;
+
+        dist = _mm_andnot_pd(signbit, _mm_sub_pd(_mm_loadu_pd(nq->network.b + i), vb));
+        dist = _mm_add_pd(dist, _mm_andnot_pd(signbit, _mm_sub_pd(_mm_loadu_pd(nq->network.r + i), vr)));
+        dist = _mm_add_pd(dist, _mm_andnot_pd(signbit, _mm_sub_pd(_mm_loadu_pd(nq->network.g + i), vg)));
+        dist = _mm_add_pd(dist, _mm_andnot_pd(signbit, _mm_sub_pd(_mm_loadu_pd(nq->network.al + i), val)));
+
+        bias = _mm_loadu_pd(nq->bias + i);
+        biasdist = _mm_sub_pd(dist, bias);
+
+        m = _mm_cmplt_pd(dist, bestd_v);
+        bestd_v = _mm_or_pd(_mm_and_pd(m, dist), _mm_andnot_pd(m, bestd_v));
+        bestpos_v = _mm_or_pd(_mm_and_pd(m, pos), _mm_andnot_pd(m, bestpos_v));
+        m = _mm_cmplt_pd(biasdist, bestbiasd_v);
+        bestbiasd_v = _mm_or_pd(_mm_and_pd(m, biasdist), _mm_andnot_pd(m, bestbiasd_v));
+        bestbiaspos_v = _mm_or_pd(_mm_and_pd(m, pos), _mm_andnot_pd(m, bestbiaspos_v));
+
+        freq = _mm_loadu_pd(nq->freq + i);
+        betafreq = _mm_div_pd(freq, betadiv);
+        _mm_storeu_pd(nq->freq + i, _mm_sub_pd(freq, betafreq));
+        _mm_storeu_pd(nq->bias + i, _mm_add_pd(bias, _mm_mul_pd(betafreq, gammamul)));
+
+        pos = _mm_add_pd(pos, two);
+    }
+
+    _mm_storeu_pd(d, bestd_v); _mm_storeu_pd(p, bestpos_v);
+    reduce_lanes(d, p, 2, &bestd, &bestpos);
+    _mm_storeu_pd(d, bestbiasd_v); _mm_storeu_pd(p, bestbiaspos_v);
+    reduce_lanes(d, p, 2, &bestbiasd, &bestbiaspos);
+
+    contest_tail(nq, n, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    nq->freq[bestpos] += beta;
+    nq->bias[bestpos] -= betagamma;
+    return(bestbiaspos);
+}
+
+/* Four neurons per step */
+__attribute__((target("avx")))
+static int contest_avx(nq_context *nq, double al,double b,double g,double r)
+{
+    const __m256d signbit = _mm256_set1_pd(-0.0);
+    const __m256d vb = _mm256_set1_pd(b), vr = _mm256_set1_pd(r);
+    const __m256d vg = _mm256_set1_pd(g), val = _mm256_set1_pd(al);
+    const __m256d betadiv = _mm256_set1_pd(1<< betashift);
+    const __m256d gammamul = _mm256_set1_pd(1<<gammashift);
+    const __m256d four = _mm256_set1_pd(4.0);
+    __m256d pos = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    __m256d bestd_v = _mm256_set1_pd(1<<30), bestpos_v = _mm256_setzero_pd();
+    __m256d bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    double d[4], p[4];
+    double bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, n = nq->netsize & ~3u;
+
+    for (i=0; i<n; i+=4)
+    {
+        __m256d dist, biasdist, freq, bias, betafreq, m;
+
+        dist = _mm256_andnot_pd(signbit, _mm256_sub_pd(_mm256_loadu_pd(nq->network.b + i), vb));
+        dist = _mm256_add_pd(dist, _mm256_andnot_pd(signbit, _mm256_sub_pd(_mm256_loadu_pd(nq->network.r + i), vr)));
+        dist = _mm256_add_pd(dist, _mm256_andnot_pd(signbit, _mm256_sub_pd(_mm256_loadu_pd(nq->network.g + i), vg)));
+        dist = _mm256_add_pd(dist, _mm256_andnot_pd(signbit, _mm256_sub_pd(_mm256_loadu_pd(nq->network.al + i), val)));
+
+        bias = _mm256_loadu_pd(nq->bias + i);
+        biasdist = _mm256_sub_pd(dist, bias);
+
+        m = _mm256_cmp_pd(dist, bestd_v, _CMP_LT_OQ);
+        bestd_v = _mm256_or_pd(_mm256_and_pd(m, dist), _mm256_andnot_pd(m, bestd_v));
+        bestpos_v = _mm256_or_pd(_mm256_and_pd(m, pos), _mm256_andnot_pd(m, bestpos_v));
+        m = _mm256_cmp_pd(biasdist, bestbiasd_v, _CMP_LT_OQ);
+        bestbiasd_v = _mm256_or_pd(_mm256_and_pd(m, biasdist), _mm256_andnot_pd(m, bestbiasd_v));
+        bestbiaspos_v = _mm256_or_pd(_mm256_and_pd(m, pos), _mm256_andnot_pd(m, bestbiaspos_v));
+
+        freq = _mm256_loadu_pd(nq->freq + i);
+        betafreq = _mm256_div_pd(freq, betadiv);
+        _mm256_storeu_pd(nq->freq + i, _mm256_sub_pd(freq, betafreq));
+        _mm256_storeu_pd(nq->bias + i, _mm256_add_pd(bias, _mm256_mul_pd(betafreq, gammamul)));
+
+        pos = _mm256_add_pd(pos, four);
+    }
+
+    _mm256_storeu_pd(d, bestd_v); _mm256_storeu_pd(p, bestpos_v);
+    reduce_lanes(d, p, 4, &bestd, &bestpos);
+    _mm256_storeu_pd(d, bestbiasd_v); _mm256_storeu_pd(p, bestbiaspos_v);
+    reduce_lanes(d, p, 4, &bestbiasd, &bestbiaspos);
+
+    contest_tail(nq, n, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    nq->freq[bestpos] += beta;
+    nq->bias[bestpos] -= betagamma;
+    return(bestbiaspos);
+}
+
+/* Single precision, four and eight neurons per step */
+
+static inline void reduce_lanes_float(const float *d, const float *pos, int lanes,
+                                      float *bestd, unsigned int *bestpos)
+{
+    int k;
+    for (k=0; k<lanes; k++) {
+        if (d[k] < *bestd || (d[k] == *bestd && pos[k] < *bestpos)) {
+            *bestd = d[k];
+            *bestpos = pos[k];
+        }
+    }
+}
+
+static inline void contest_float_tail(nq_context *nq, unsigned int from,
+                                      float al, float b, float g, float r,
+                                      float *bestd, unsigned int *bestpos,
+                                      float *bestbiasd, unsigned int *bestbiaspos)
+{
+    nq_float_network *n = &nq->fnet;
+    unsigned int i; float dist,biasdist,betafreq;
+
+    for (i=from; i<nq->netsize; i++)
+    {
+        dist = fabsf(n->b[i] - b);
+        dist += fabsf(n->r[i] - r);
+        dist += fabsf(n->g[i] - g);
+        dist += fabsf(n->al[i] - al);
+
+        biasdist = dist - n->bias[i];
+        if (dist<*bestd) {*bestd=dist; *bestpos=i;}
+        if (biasdist<*bestbiasd) {*bestbiasd=biasdist; *bestbiaspos=i;}
+
+        betafreq = n->freq[i] / (1<< betashift);
+        n->freq[i] -= betafreq;
+        n->bias[i] += betafreq * (1<<gammashift);
+    }
+}
+
+__attribute__((target("sse2")))
+static int contest_float_sse2(nq_context *nq, float al,float b,float g,float r)
+{
+    nq_float_network *n = &nq->fnet;
+    const __m128 signbit = _mm_set1_ps(-0.0f);
+    const __m128 vb = _mm_set1_ps(b), vr = _mm_set1_ps(r);
+    const __m128 vg = _mm_set1_ps(g), val = _mm_set1_ps(al);
+    const __m128 betadiv = _mm_set1_ps(1<< betashift);
+    const __m128 gammamul = _mm_set1_ps(1<<gammashift);
+    const __m128 four = _mm_set1_ps(4.0f);
+    __m128 pos = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 bestd_v = _mm_set1_ps(1<<30), bestpos_v = _mm_setzero_ps();
+    __m128 bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    float d[4], p[4];
+    float bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, end = nq->netsize & ~3u;
+
+    for (i=0; i<end; i+=4)
+    {
+        __m128 dist, biasdist, freq, bias, betafreq, m;
+
+        dist = _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(n->b + i), vb));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(n->r + i), vr)));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(n->g + i), vg)));
+        dist = _mm_add_ps(dist, _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(n->al + i), val)));
+
+        bias = _mm_loadu_ps(n->bias + i);
+        biasdist = _mm_sub_ps(dist, bias);
+
+        m = _mm_cmplt_ps(dist, bestd_v);
+        bestd_v = _mm_or_ps(_mm_and_ps(m, dist), _mm_andnot_ps(m, bestd_v));
+        bestpos_v = _mm_or_ps(_mm_and_ps(m, pos), _mm_andnot_ps(m, bestpos_v));
+        m = _mm_cmplt_ps(biasdist, bestbiasd_v);
+        bestbiasd_v = _mm_or_ps(_mm_and_ps(m, biasdist), _mm_andnot_ps(m, bestbiasd_v));
+        bestbiaspos_v = _mm_or_ps(_mm_and_ps(m, pos), _mm_andnot_ps(m, bestbiaspos_v));
+
+        freq = _mm_loadu_ps(n->freq + i);
+        betafreq = _mm_div_ps(freq, betadiv);
+        _mm_storeu_ps(n->freq + i, _mm_sub_ps(freq, betafreq));
+        _mm_storeu_ps(n->bias + i, _mm_add_ps(bias, _mm_mul_ps(betafreq, gammamul)));
+
+        pos = _mm_add_ps(pos, four);
+    }
+
+    _mm_storeu_ps(d, bestd_v); _mm_storeu_ps(p, bestpos_v);
+    reduce_lanes_float(d, p, 4, &bestd, &bestpos);
+    _mm_storeu_ps(d, bestbiasd_v); _mm_storeu_ps(p, bestbiaspos_v);
+    reduce_lanes_float(d, p, 4, &bestbiasd, &bestbiaspos);
+
+    contest_float_tail(nq, end, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    n->freq[bestpos] += (float)beta;
+    n->bias[bestpos] -= (float)betagamma;
+    return(bestbiaspos);
+}
+
+__attribute__((target("avx")))
+static int contest_float_avx(nq_context *nq, float al,float b,float g,float r)
+{
+    nq_float_network *n = &nq->fnet;
+    const __m256 signbit = _mm256_set1_ps(-0.0f);
+    const __m256 vb = _mm256_set1_ps(b), vr = _mm256_set1_ps(r);
+    const __m256 vg = _mm256_set1_ps(g), val = _mm256_set1_ps(al);
+    const __m256 betadiv = _mm256_set1_ps(1<< betashift);
+    const __m256 gammamul = _mm256_set1_ps(1<<gammashift);
+    const __m256 eight = _mm256_set1_ps(8.0f);
+    __m256 pos = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    __m256 bestd_v = _mm256_set1_ps(1<<30), bestpos_v = _mm256_setzero_ps();
+    __m256 bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    float d[8], p[8];
+    float bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, end = nq->netsize & ~7u;
+
+    for (i=0; i<end; i+=8)
+    {
+        __m256 dist, biasdist, freq, bias, betafreq, m;
+
+        dist = _mm256_andnot_ps(signbit, _mm256_sub_ps(_mm256_loadu_ps(n->b + i), vb));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(signbit, _mm256_sub_ps(_mm256_loadu_ps(n->r + i), vr)));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(signbit, _mm256_sub_ps(_mm256_loadu_ps(n->g + i), vg)));
+        dist = _mm256_add_ps(dist, _mm256_andnot_ps(signbit, _mm256_sub_ps(_mm256_loadu_ps(n->al + i), val)));
+
+        bias = _mm256_loadu_ps(n->bias + i);
+        biasdist = _mm256_sub_ps(dist, bias);
+
+        m = _mm256_cmp_ps(dist, bestd_v, _CMP_LT_OQ);
+        bestd_v = _mm256_or_ps(_mm256_and_ps(m, dist), _mm256_andnot_ps(m, bestd_v));
+        bestpos_v = _mm256_or_ps(_mm256_and_ps(m, pos), _mm256_andnot_ps(m, bestpos_v));
+        m = _mm256_cmp_ps(biasdist, bestbiasd_v, _CMP_LT_OQ);
+        bestbiasd_v = _mm256_or_ps(_mm256_and_ps(m, biasdist), _mm256_andnot_ps(m, bestbiasd_v));
+        bestbiaspos_v = _mm256_or_ps(_mm256_and_ps(m, pos), _mm256_andnot_ps(m, bestbiaspos_v));
+
+        freq = _mm256_loadu_ps(n->freq + i);
+        betafreq = _mm256_div_ps(freq, betadiv);
+        _mm256_storeu_ps(n->freq + i, _mm256_sub_ps(freq, betafreq));
+        _mm256_storeu_ps(n->bias + i, _mm256_add_ps(bias, _mm256_mul_ps(betafreq, gammamul)));
+
+        pos = _mm256_add_ps(pos, eight);
+    }
+
+    _mm256_storeu_ps(d, bestd_v); _mm256_storeu_ps(p, bestpos_v);
+    reduce_lanes_float(d, p, 8, &bestd, &bestpos);
+    _mm256_storeu_ps(d, bestbiasd_v); _mm256_storeu_ps(p, bestbiaspos_v);
+    reduce_lanes_float(d, p, 8, &bestbiasd, &bestbiaspos);
+
+    contest_float_tail(nq, end, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    n->freq[bestpos] += (float)beta;
+    n->bias[bestpos] -= (float)betagamma;
+    return(bestbiaspos);
+}
+
+
+/* Fixed point, four and eight neurons per step */
+
+static inline void reduce_lanes_fixed(const int *d, const int *pos, int lanes,
+                                      int *bestd, unsigned int *bestpos)
+{
+    int k;
+    for (k=0; k<lanes; k++) {
+        if (d[k] < *bestd || (d[k] == *bestd && (unsigned int)pos[k] < *bestpos)) {
+            *bestd = d[k];
+            *bestpos = pos[k];
+        }
+    }
+}
+
+static inline void contest_fixed_tail(nq_context *nq, unsigned int from,
+                                      int al, int b, int g, int r,
+                                      int *bestd, unsigned int *bestpos,
+                                      int *bestbiasd, unsigned int *bestbiaspos)
+{
+    nq_fixed_network *n = &nq->inet;
+    unsigned int i; int dist,biasdist,a,betafreq;
+
+    for (i=from; i<nq->netsize; i++)
+    {
+        a = n->b[i] - b;
+        dist = ABS(a);
+        a = n->r[i] - r;
+        dist += ABS(a);
+        a = n->g[i] - g;
+        dist += ABS(a);
+        a = n->al[i] - al;
+        dist += ABS(a);
+
+        biasdist = dist - (n->bias[i] >> (intbiasshift-netbiasshift));
+        if (dist<*bestd) {*bestd=dist; *bestpos=i;}
+        if (biasdist<*bestbiasd) {*bestbiasd=biasdist; *bestbiaspos=i;}
+
+        betafreq = n->freq[i] >> betashift;
+        n->freq[i] -= betafreq;
+        n->bias[i] += betafreq << gammashift;
+    }
+}
+
+/* |a| for 32 bit lanes with plain SSE2 */
+__attribute__((target("sse2")))
+static inline __m128i abs_epi32_sse2(__m128i a)
+{
+    __m128i sign = _mm_srai_epi32(a, 31);
+    return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+
+__attribute__((target("sse2")))
+static int contest_fixed_sse2(nq_context *nq, int al,int b,int g,int r)
+{
+    nq_fixed_network *n = &nq->inet;
+    const __m128i vb = _mm_set1_epi32(b), vr = _mm_set1_epi32(r);
+    const __m128i vg = _mm_set1_epi32(g), val = _mm_set1_epi32(al);
+    const __m128i four = _mm_set1_epi32(4);
+    __m128i pos = _mm_set_epi32(3, 2, 1, 0);
+    __m128i bestd_v = _mm_set1_epi32(1<<30), bestpos_v = _mm_setzero_si128();
+    __m128i bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    int d[4], p[4];
+    int bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, end = nq->netsize & ~3u;
+
+    for (i=0; i<end; i+=4)
+    {
+        __m128i dist, biasdist, freq, bias, betafreq, m;
+
+        dist = abs_epi32_sse2(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(n->b + i)), vb));
+        dist = _mm_add_epi32(dist, abs_epi32_sse2(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(n->r + i)), vr)));
+        dist = _mm_add_epi32(dist, abs_epi32_sse2(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(n->g + i)), vg)));
+        dist = _mm_add_epi32(dist, abs_epi32_sse2(_mm_sub_epi32(_mm_loadu_si128((const __m128i *)(n->al + i)), val)));
+
+        bias = _mm_loadu_si128((const __m128i *)(n->bias + i));
+        biasdist = _mm_sub_epi32(dist, _mm_srai_epi32(bias, intbiasshift-netbiasshift));
+
+        m = _mm_cmplt_epi32(dist, bestd_v);
+        bestd_v = _mm_or_si128(_mm_and_si128(m, dist), _mm_andnot_si128(m, bestd_v));
+        bestpos_v = _mm_or_si128(_mm_and_si128(m, pos), _mm_andnot_si128(m, bestpos_v));
+        m = _mm_cmplt_epi32(biasdist, bestbiasd_v);
+        bestbiasd_v = _mm_or_si128(_mm_and_si128(m, biasdist), _mm_andnot_si128(m, bestbiasd_v));
+        bestbiaspos_v = _mm_or_si128(_mm_and_si128(m, pos), _mm_andnot_si128(m, bestbiaspos_v));
+
+        freq = _mm_loadu_si128((const __m128i *)(n->freq + i));
+        betafreq = _mm_srai_epi32(freq, betashift);
+        _mm_storeu_si128((__m128i *)(n->freq + i), _mm_sub_epi32(freq, betafreq));
+        _mm_storeu_si128((__m128i *)(n->bias + i), _mm_add_epi32(bias, _mm_slli_epi32(betafreq, gammashift)));
+
+        pos = _mm_add_epi32(pos, four);
+    }
+
+    _mm_storeu_si128((__m128i *)d, bestd_v); _mm_storeu_si128((__m128i *)p, bestpos_v);
+    reduce_lanes_fixed(d, p, 4, &bestd, &bestpos);
+    _mm_storeu_si128((__m128i *)d, bestbiasd_v); _mm_storeu_si128((__m128i *)p, bestbiaspos_v);
+    reduce_lanes_fixed(d, p, 4, &bestbiasd, &bestbiaspos);
+
+    contest_fixed_tail(nq, end, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    n->freq[bestpos] += intbeta;
+    n->bias[bestpos] -= intbetagamma;
+    return(bestbiaspos);
+}
+
+__attribute__((target("avx2")))
+static int contest_fixed_avx2(nq_context *nq, int al,int b,int g,int r)
+{
+    nq_fixed_network *n = &nq->inet;
+    const __m256i vb = _mm256_set1_epi32(b), vr = _mm256_set1_epi32(r);
+    const __m256i vg = _mm256_set1_epi32(g), val = _mm256_set1_epi32(al);
+    const __m256i eight = _mm256_set1_epi32(8);
+    __m256i pos = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256i bestd_v = _mm256_set1_epi32(1<<30), bestpos_v = _mm256_setzero_si256();
+    __m256i bestbiasd_v = bestd_v, bestbiaspos_v = bestpos_v;
+    int d[8], p[8];
+    int bestd = 1<<30, bestbiasd = 1<<30;
+    unsigned int bestpos = 0, bestbiaspos = 0;
+    unsigned int i, end = nq->netsize & ~7u;
+
+    for (i=0; i<end; i+=8)
+    {
+        __m256i dist, biasdist, freq, bias, betafreq, m;
+
+        dist = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(n->b + i)), vb));
+        dist = _mm256_add_epi32(dist, _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(n->r + i)), vr)));
+        dist = _mm256_add_epi32(dist, _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(n->g + i)), vg)));
+        dist = _mm256_add_epi32(dist, _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(n->al + i)), val)));
+
+        bias = _mm256_loadu_si256((const __m256i *)(n->bias + i));
+        biasdist = _mm256_sub_epi32(dist, _mm256_srai_epi32(bias, intbiasshift-netbiasshift));
+
+        m = _mm256_cmpgt_epi32(bestd_v, dist);
+        bestd_v = _mm256_blendv_epi8(bestd_v, dist, m);
+        bestpos_v = _mm256_blendv_epi8(bestpos_v, pos, m);
+        m = _mm256_cmpgt_epi32(bestbiasd_v, biasdist);
+        bestbiasd_v = _mm256_blendv_epi8(bestbiasd_v, biasdist, m);
+        bestbiaspos_v = _mm256_blendv_epi8(bestbiaspos_v, pos, m);
+
+        freq = _mm256_loadu_si256((const __m256i *)(n->freq + i));
+        betafreq = _mm256_srai_epi32(freq, betashift);
+        _mm256_storeu_si256((__m256i *)(n->freq + i), _mm256_sub_epi32(freq, betafreq));
+        _mm256_storeu_si256((__m256i *)(n->bias + i), _mm256_add_epi32(bias, _mm256_slli_epi32(betafreq, gammashift)));
+
+        pos = _mm256_add_epi32(pos, eight);
+    }
+
+    _mm256_storeu_si256((__m256i *)d, bestd_v); _mm256_storeu_si256((__m256i *)p, bestpos_v);
+    reduce_lanes_fixed(d, p, 8, &bestd, &bestpos);
+    _mm256_storeu_si256((__m256i *)d, bestbiasd_v); _mm256_storeu_si256((__m256i *)p, bestbiaspos_v);
+    reduce_lanes_fixed(d, p, 8, &bestbiasd, &bestbiaspos);
+
+    contest_fixed_tail(nq, end, al, b, g, r, &bestd, &bestpos, &bestbiasd, &bestbiaspos);
+
+    n->freq[bestpos] += intbeta;
+    n->bias[bestpos] -= intbetagamma;
+    return(bestbiaspos);
+}
+
+#endif /* NQ_X86_SIMD */
+
+static void select_kernels(nq_context *nq)
+{
+    nq->contest = contest_scalar;
+    nq->contest_float = contest_float_scalar;
+    nq->contest_fixed = contest_fixed_scalar;
+    nq->brute = brute_scalar;
+#ifdef NQ_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        nq->contest = contest_sse2;
+        nq->contest_float = contest_float_sse2;
+        nq->contest_fixed = contest_fixed_sse2;
+        nq->brute = brute_sse2;
+    }
+    if (__builtin_cpu_supports("avx")) {
+        nq->contest = contest_avx;
+        nq->contest_float = contest_float_avx;
+        nq->brute = brute_avx;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        nq->contest_fixed = contest_fixed_avx2;
+    }
+#endif
+}
+
 
 /* Move neuron i towards biased (a,b,g,r) by factor alpha
    ---------------------------------------------------- */
 
-static void altersingle(double alpha,unsigned int i,double al,double b,double g,double r)
+static void altersingle(nq_context *nq, double alpha,unsigned int i,double al,double b,double g,double r)
 {    
     double colorimp = 1.0;//0.5;// + 0.7*colorimportance(al);
     
     alpha /= initalpha;
     
     /* alter hit neuron */
-    network[i].al -= alpha*(network[i].al - al);
-    network[i].b -= colorimp*alpha*(network[i].b - b);
-    network[i].g -= colorimp*alpha*(network[i].g - g);
-    network[i].r -= colorimp*alpha*(network[i].r - r);
+    nq->network.al[i] -= alpha*(nq->network.al[i] - al);
+    nq->network.b[i] -= colorimp*alpha*(nq->network.b[i] - b);
+    nq->network.g[i] -= colorimp*alpha*(nq->network.g[i] - g);
+    nq->network.r[i] -= colorimp*alpha*(nq->network.r[i] - r);
 }
 
 
 /* Move adjacent neurons by precomputed alpha*(1-((i-j)^2/[r]^2)) in radpower[|i-j|]
    --------------------------------------------------------------------------------- */
 
-static void alterneigh(unsigned int rad,unsigned int i,double al,double b,double g,double r)
+static void alterneigh(nq_context *nq, const double *radpower, unsigned int rad,unsigned int i,double al,double b,double g,double r)
 {
     unsigned int j,hi;
     int k,lo;
-    double *q,a;
+    const double *q;
+    double a;
 
     lo = i-rad;   if (lo<0) lo=0;
-    hi = i+rad;   if (hi>netsize-1) hi=netsize-1;
+    hi = i+rad;   if (hi>nq->netsize-1) hi=nq->netsize-1;
 
     j = i+1;
     k = i-1;
@@ -414,38 +1417,300 @@ static void alterneigh(unsigned int rad,unsigned int i,double al,double b,double
     while ((j<=hi) || (k>=lo)) {
         a = (*(++q)) / alpharadbias;
         if (j<=hi) {
-            network[j].al -= a*(network[j].al - al);
-            network[j].b  -= a*(network[j].b  - b) ;
-            network[j].g  -= a*(network[j].g  - g) ;
-            network[j].r  -= a*(network[j].r  - r) ;
+            nq->network.al[j] -= a*(nq->network.al[j] - al);
+            nq->network.b[j]  -= a*(nq->network.b[j]  - b) ;
+            nq->network.g[j]  -= a*(nq->network.g[j]  - g) ;
+            nq->network.r[j]  -= a*(nq->network.r[j]  - r) ;
             j++;
         }
         if (k>=lo) {
-            network[k].al -= a*(network[k].al - al);
-            network[k].b  -= a*(network[k].b  - b) ;
-            network[k].g  -= a*(network[k].g  - g) ;
-            network[k].r  -= a*(network[k].r  - r) ;
+            nq->network.al[k] -= a*(nq->network.al[k] - al);
+            nq->network.b[k]  -= a*(nq->network.b[k]  - b) ;
+            nq->network.g[k]  -= a*(nq->network.g[k]  - g) ;
+            nq->network.r[k]  -= a*(nq->network.r[k]  - r) ;
             k--;
         }
     }
 }
 
 
+/* altersingle() and alterneigh() for the lower precision training modes
+   --------------------------------------------------------------------- */
+
+static void altersingle_float(nq_context *nq, float alpha,unsigned int i,float al,float b,float g,float r)
+{
+    nq_float_network *n = &nq->fnet;
+
+    alpha /= (float)initalpha;
+
+    n->al[i] -= alpha*(n->al[i] - al);
+    n->b[i] -= alpha*(n->b[i] - b);
+    n->g[i] -= alpha*(n->g[i] - g);
+    n->r[i] -= alpha*(n->r[i] - r);
+}
+
+static void alterneigh_float(nq_context *nq, const double *radpower, unsigned int rad,unsigned int i,float al,float b,float g,float r)
+{
+    nq_float_network *n = &nq->fnet;
+    unsigned int j,hi;
+    int k,lo;
+    const double *q;
+    float a;
+
+    lo = i-rad;   if (lo<0) lo=0;
+    hi = i+rad;   if (hi>nq->netsize-1) hi=nq->netsize-1;
+
+    j = i+1;
+    k = i-1;
+    q = radpower;
+    while ((j<=hi) || (k>=lo)) {
+        a = (*(++q)) / alpharadbias;
+        if (j<=hi) {
+            n->al[j] -= a*(n->al[j] - al);
+            n->b[j]  -= a*(n->b[j]  - b) ;
+            n->g[j]  -= a*(n->g[j]  - g) ;
+            n->r[j]  -= a*(n->r[j]  - r) ;
+            j++;
+        }
+        if (k>=lo) {
+            n->al[k] -= a*(n->al[k] - al);
+            n->b[k]  -= a*(n->b[k]  - b) ;
+            n->g[k]  -= a*(n->g[k]  - g) ;
+            n->r[k]  -= a*(n->r[k]  - r) ;
+            k--;
+        }
+    }
+}
+
+static void altersingle_fixed(nq_context *nq, int alpha,unsigned int i,int al,int b,int g,int r)
+{
+    nq_fixed_network *n = &nq->inet;
+
+    n->al[i] -= (alpha*(n->al[i] - al)) / (1<<alphabiasshift);
+    n->b[i] -= (alpha*(n->b[i] - b)) / (1<<alphabiasshift);
+    n->g[i] -= (alpha*(n->g[i] - g)) / (1<<alphabiasshift);
+    n->r[i] -= (alpha*(n->r[i] - r)) / (1<<alphabiasshift);
+}
+
+static void alterneigh_fixed(nq_context *nq, const double *radpower, unsigned int rad,unsigned int i,int al,int b,int g,int r)
+{
+    nq_fixed_network *n = &nq->inet;
+    unsigned int j,hi;
+    int k,lo;
+    const double *q;
+    int a;
+
+    lo = i-rad;   if (lo<0) lo=0;
+    hi = i+rad;   if (hi>nq->netsize-1) hi=nq->netsize-1;
+
+    j = i+1;
+    k = i-1;
+    q = radpower;
+    while ((j<=hi) || (k>=lo)) {
+        a = *(++q);                     /* radpower values are whole numbers, and so
+                                           are learn()'s wradpower in fixed point */
+        if (j<=hi) {
+            n->al[j] -= (a*(n->al[j] - al)) / (1<<alpharadbshift);
+            n->b[j]  -= (a*(n->b[j]  - b))  / (1<<alpharadbshift);
+            n->g[j]  -= (a*(n->g[j]  - g))  / (1<<alpharadbshift);
+            n->r[j]  -= (a*(n->r[j]  - r))  / (1<<alpharadbshift);
+            j++;
+        }
+        if (k>=lo) {
+            n->al[k] -= (a*(n->al[k] - al)) / (1<<alpharadbshift);
+            n->b[k]  -= (a*(n->b[k]  - b))  / (1<<alpharadbshift);
+            n->g[k]  -= (a*(n->g[k]  - g))  / (1<<alpharadbshift);
+            n->r[k]  -= (a*(n->r[k]  - r))  / (1<<alpharadbshift);
+            k--;
+        }
+    }
+}
+
+/* Copy network, bias and freq into the working arrays of the selected
+   precision before learning, and the network back afterwards */
+static void load_training_state(nq_context *nq)
+{
+    unsigned int i;
+
+    for (i=0; i<nq->netsize; i++) {
+        switch (nq->precision) {
+        case NQ_PRECISION_FLOAT:
+            nq->fnet.al[i] = nq->network.al[i];
+            nq->fnet.b[i] = nq->network.b[i];
+            nq->fnet.g[i] = nq->network.g[i];
+            nq->fnet.r[i] = nq->network.r[i];
+            nq->fnet.bias[i] = nq->bias[i];
+            nq->fnet.freq[i] = nq->freq[i];
+            break;
+        case NQ_PRECISION_FIXED:
+            nq->inet.al[i] = lround(nq->network.al[i] * (1<<netbiasshift));
+            nq->inet.b[i] = lround(nq->network.b[i] * (1<<netbiasshift));
+            nq->inet.g[i] = lround(nq->network.g[i] * (1<<netbiasshift));
+            nq->inet.r[i] = lround(nq->network.r[i] * (1<<netbiasshift));
+            nq->inet.bias[i] = lround(nq->bias[i] * intbias);
+            nq->inet.freq[i] = lround(nq->freq[i] * intbias);
+            break;
+        }
+    }
+}
+
+static void store_training_state(nq_context *nq)
+{
+    unsigned int i;
+
+    for (i=0; i<nq->netsize; i++) {
+        switch (nq->precision) {
+        case NQ_PRECISION_FLOAT:
+            nq->network.al[i] = nq->fnet.al[i];
+            nq->network.b[i] = nq->fnet.b[i];
+            nq->network.g[i] = nq->fnet.g[i];
+            nq->network.r[i] = nq->fnet.r[i];
+            nq->bias[i] = nq->fnet.bias[i];
+            nq->freq[i] = nq->fnet.freq[i];
+            break;
+        case NQ_PRECISION_FIXED:
+            nq->network.al[i] = nq->inet.al[i] / (double)(1<<netbiasshift);
+            nq->network.b[i] = nq->inet.b[i] / (double)(1<<netbiasshift);
+            nq->network.g[i] = nq->inet.g[i] / (double)(1<<netbiasshift);
+            nq->network.r[i] = nq->inet.r[i] / (double)(1<<netbiasshift);
+            nq->bias[i] = nq->inet.bias[i] / (double)intbias;
+            nq->freq[i] = nq->inet.freq[i] / (double)intbias;
+            break;
+        }
+    }
+}
+
+
+/* Pixel p of the picture as RGBA: p itself, or gray, gray+alpha or RGB
+   expanded into px
+   ----------------------------------------------------------------------- */
+static inline const unsigned char *rgbapixel(const nq_context *nq, const unsigned char *p, unsigned char *px)
+{
+    switch (nq->channels) {
+    case 1: px[0] = px[1] = px[2] = p[0]; px[3] = 255; return px;
+    case 2: px[0] = px[1] = px[2] = p[0]; px[3] = p[1]; return px;
+    case 3: px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; px[3] = 255; return px;
+    default: return p;
+    }
+}
+
+/* The fraction of pixel p of the picture, as rgbapixel() lays it out */
+static inline const signed char *rgbafraction(const nq_context *nq, const unsigned char *p, signed char *fx)
+{
+    const signed char *f = nq->thefraction + (p - nq->thepicture);
+
+    switch (nq->channels) {
+    case 1: fx[0] = fx[1] = fx[2] = f[0]; fx[3] = 0; return fx;
+    case 2: fx[0] = fx[1] = fx[2] = f[0]; fx[3] = f[1]; return fx;
+    case 3: fx[0] = f[0]; fx[1] = f[1]; fx[2] = f[2]; fx[3] = 0; return fx;
+    default: return f;
+    }
+}
+
+
+/* Count the distinct colours of the picture. Fully transparent pixels all
+   count as one colour, as learn() treats them alike. Returns the colours
+   packed at the start of a malloc()ed array, or NULL if there are more
+   than maxcolours of them (or no memory)
+   ---------------------------------------------------------------------- */
+static nq_histitem *build_histogram(const nq_context *nq, unsigned int maxcolours, unsigned int *colours)
+{
+    nq_histitem *hist;
+    unsigned int bits,mask,n,h,i,rgba,last;
+    const unsigned char *p, *q, *lim;
+    unsigned char px[4];
+
+    for (bits=1; (1u<<bits) < 2*maxcolours; bits++);
+    mask = (1u<<bits)-1;
+    hist = (nq_histitem *)calloc(mask+1, sizeof(nq_histitem));
+    if (!hist) return NULL;
+
+    n = 0;
+    h = 0;
+    last = 0;
+    lim = nq->thepicture + nq->lengthcount;
+    for (p = nq->thepicture; p < lim; p += nq->channels) {
+        q = rgbapixel(nq, p, px);
+        rgba = q[3] ? (q[0] | q[1]<<8 | q[2]<<16 | (unsigned int)q[3]<<24) : 0;
+        if (rgba != last || !hist[h].count) {  /* runs of one colour are common */
+            h = (rgba * 0x9E3779B1u) >> (32-bits);
+            while (hist[h].count && hist[h].rgba != rgba) h = (h+1) & mask;
+            if (!hist[h].count) {
+                if (++n > maxcolours) {
+                    free(hist);
+                    return NULL;
+                }
+                hist[h].rgba = rgba;
+            }
+            last = rgba;
+        }
+        hist[h].count++;
+    }
+
+    for (i=0, n=0; i<=mask; i++)
+        if (hist[i].count) hist[n++] = hist[i];
+    *colours = n;
+    return hist;
+}
+
+/* One of the four primes that does not divide len
+   ------------------------------------------------ */
+static unsigned int learnstep(size_t len)
+{
+    if ((len%prime1) != 0) return prime1;
+    if ((len%prime2) != 0) return prime2;
+    if ((len%prime3) != 0) return prime3;
+    return prime4;
+}
+
+
 /* Main Learning Loop
    ------------------ */
 /* sampling factor 1..30 */
-void learn(unsigned int samplefac, unsigned int verbose) /* Stu: N.B. added parameter so that main() could control verbosity. */
+void learn(nq_context *nq, unsigned int samplefac, unsigned int verbose) /* Stu: N.B. added parameter so that main() could control verbosity. */
 {
-    unsigned int i,j,al,b,g,r;
-    unsigned int rad,step,delta,samplepixels;
-    double radius,alpha;
+    unsigned int j;
+    double al,b,g,r;
+    int ial,ib,ig,ir;
+    unsigned int rad,step;
+    size_t i,delta,samplepixels;
+    double radius,alpha,weight,wscale;
+    double a,acarry,rcarry[initrad+1];  /* rounding left over, fixed point histogram only */
     unsigned char *p;
     unsigned char *lim;
+    const unsigned char *q;
+    const double *rp;
+    unsigned char px[4], pix[4];
+    static const signed char nofrac[4];
+    const signed char *f;
+    signed char fx[4];
+    nq_histitem *hist;
+    unsigned int colours=0,maxcolours,h;
+#if defined(NQ_X86_SIMD) && defined(__SSE__)
+    unsigned int csr;
+#endif
     
-    alphadec = 30 + ((samplefac-1)/3);
-    p = thepicture;
-    lim = thepicture + lengthcount;
-    samplepixels = lengthcount/(4*samplefac); 
+    nq->alphadec = 30 + ((samplefac-1)/3);
+    p = nq->thepicture;
+    lim = nq->thepicture + nq->lengthcount;
+    samplepixels = nq->lengthcount/(nq->channels*samplefac); 
+
+    /* With few distinct colours it is cheaper to present each of them
+       histrounds times, weighted by its pixel count, than to sample pixels.
+       Pixels with fractions all differ. */
+    hist = NULL;
+    wscale = 0;
+    maxcolours = samplepixels <= histminsamples || nq->thefraction ? 0 :
+        samplepixels/histrounds > 1u<<histmaxbits ? 1u<<histmaxbits : samplepixels/histrounds;
+    if (maxcolours) hist = build_histogram(nq, maxcolours, &colours);
+    if (hist) {
+        samplepixels = (size_t)colours*histrounds;
+        if (samplepixels < histminsamples) samplepixels = histminsamples;
+        nq->alphadec = 30 + ((nq->lengthcount/(nq->channels*samplepixels))-1)/3; /* as for the equivalent samplefac */
+        wscale = colours / (double)(nq->lengthcount/nq->channels);
+        if(verbose) fprintf(stderr,"training on %u distinct colours\n", colours);
+    }
+
     delta = samplepixels/ncycles;  /* here's a problem with small images: samplepixels < ncycles => delta = 0 */
     if(delta==0) delta = 1;        /* kludge to fix */
     alpha = initalpha;
@@ -454,50 +1719,110 @@ void learn(unsigned int samplefac, unsigned int verbose) /* Stu: N.B. added para
     rad = radius;
     if (rad <= 1) rad = 0;
     for (i=0; i<rad; i++) 
-        radpower[i] = floor( alpha*(((rad*rad - i*i)*radbias)/(rad*rad)) );
+        nq->radpower[i] = floor( alpha*(((rad*rad - i*i)*radbias)/(rad*rad)) );
     
     if(verbose) fprintf(stderr,"beginning 1D learning: initial radius=%d\n", rad);
 
-    if ((lengthcount%prime1) != 0) step = 4*prime1;
-    else {
-        if ((lengthcount%prime2) !=0) step = 4*prime2;
-        else {
-            if ((lengthcount%prime3) !=0) step = 4*prime3;
-            else step = 4*prime4;
-        }
-    }
+    load_training_state(nq);
+
+#if defined(NQ_X86_SIMD) && defined(__SSE__)
+    /* freq[] of neurons that never win decays towards zero; in single
+       precision it becomes denormal after ~90000 samples, and every
+       operation on a denormal is very slow. Flush them to zero instead. */
+    csr = _mm_getcsr();
+    if (nq->precision == NQ_PRECISION_FLOAT) _mm_setcsr(csr | 0x8040); /* FTZ | DAZ */
+#endif
+
+    if (hist) step = learnstep(colours) % colours;
+    else step = nq->channels*learnstep(nq->lengthcount);	/* the same pixels in any layout */
     
     i = 0;
+    h = 0;
+    f = nofrac;
+    acarry = 0;
+    for (j=0; j<=initrad; j++) rcarry[j] = 0;
     while (i < samplepixels) 
     {
-        if (p[3])
+        if (hist) {
+            px[0] = hist[h].rgba;
+            px[1] = hist[h].rgba >> 8;
+            px[2] = hist[h].rgba >> 16;
+            px[3] = hist[h].rgba >> 24;
+            q = px;
+            weight = hist[h].count * wscale;   /* 1.0 for a colour of average frequency */
+            if (weight*alpha > initalpha) weight = initalpha/alpha;
+            for (j=0; j<=rad; j++) nq->wradpower[j] = nq->radpower[j]*weight;
+            if (nq->precision == NQ_PRECISION_FIXED) {
+                /* Fixed point takes whole rates, which would round the pull
+                   of rare colours down to nothing: pass on what they drop
+                   to the next colour instead */
+                for (j=0; j<=rad; j++) {
+                    nq->wradpower[j] += rcarry[j];
+                    rcarry[j] = nq->wradpower[j] - floor(nq->wradpower[j]);
+                    nq->wradpower[j] -= rcarry[j];
+                }
+            }
+            rp = nq->wradpower;
+            h += step;
+            if (h >= colours) h -= colours;
+        } else {
+            q = rgbapixel(nq, p, pix);
+            if (nq->thefraction) f = rgbafraction(nq, p, fx);
+            weight = 1.0;
+            rp = nq->radpower;
+            p += step;
+            while (p >= lim) p -= nq->lengthcount;
+        }
+
+        if (q[3] || f[3])
         {            
-            al =p[3];
-            b = biasvalue(p[2]);
-            g = biasvalue(p[1]);
-            r = biasvalue(p[0]);
+            al = q[3] + f[3]/256.0;
+            b = biasfraction(nq, q[2], f[2]);
+            g = biasfraction(nq, q[1], f[1]);
+            r = biasfraction(nq, q[0], f[0]);
         }
         else
         {
             al=r=g=b=0;
         }
-        j = contest(al,b,g,r);
-
-        altersingle(alpha,j,al,b,g,r);
-        if (rad) alterneigh(rad,j,al,b,g,r);   /* alter neighbours */
-
-        p += step;
-        while (p >= lim) p -= lengthcount;
+        switch (nq->precision) {
+        case NQ_PRECISION_FLOAT:
+            j = nq->contest_float(nq,al,b,g,r);
+            altersingle_float(nq,alpha*weight,j,al,b,g,r);
+            if (rad) alterneigh_float(nq,rp,rad,j,al,b,g,r);
+            break;
+        case NQ_PRECISION_FIXED:
+            ial = al*(1<<netbiasshift) + 0.5; ib = b*(1<<netbiasshift) + 0.5;
+            ig = g*(1<<netbiasshift) + 0.5; ir = r*(1<<netbiasshift) + 0.5;
+            j = nq->contest_fixed(nq,ial,ib,ig,ir);
+            a = alpha*weight;
+            if (hist) {                        /* as for wradpower[] */
+                a += acarry;
+                acarry = a - floor(a);
+            }
+            altersingle_fixed(nq,a,j,ial,ib,ig,ir);
+            if (rad) alterneigh_fixed(nq,rp,rad,j,ial,ib,ig,ir);
+            break;
+        default:
+            j = nq->contest(nq,al,b,g,r);
+            altersingle(nq,alpha*weight,j,al,b,g,r);
+            if (rad) alterneigh(nq,rp,rad,j,al,b,g,r);   /* alter neighbours */
+        }
     
         i++;
         if (i%delta == 0) {                    /* FPE here if delta=0*/ 
-            alpha -= alpha / (double)alphadec;
+            alpha -= alpha / (double)nq->alphadec;
             radius -= radius / (double)radiusdec;
             rad = radius;
             if (rad <= 1) rad = 0;
             for (j=0; j<rad; j++) 
-                radpower[j] = floor( alpha*(((rad*rad - j*j)*radbias)/(rad*rad)) );
+                nq->radpower[j] = floor( alpha*(((rad*rad - j*j)*radbias)/(rad*rad)) );
         }
     }
+#if defined(NQ_X86_SIMD) && defined(__SSE__)
+    _mm_setcsr(csr);
+#endif
+    store_training_state(nq);
+    free(hist);
     if(verbose) fprintf(stderr,"finished 1D learning: final alpha=%f !\n",((float)alpha)/initalpha);
 }
@@ -50,40 +50,77 @@
 #define minpicturebytes	(4*prime4)		/* minimum size for input image */
 
 
+/* Opaque quantizer state. Each image being quantized needs its own
+   context; separate contexts may be used concurrently from different threads.
+   ------------------------------------------------------------------------- */
+typedef struct nq_context nq_context;
+
+nq_context *nq_create(void);
+void nq_destroy(nq_context *nq);
+
+/* Arithmetic used by learn(). Lower precision is faster, at a small cost
+   in palette quality.
+   ---------------------------------------------------------------------- */
+#define NQ_PRECISION_DOUBLE	0	/* default */
+#define NQ_PRECISION_FLOAT	1	/* single precision */
+#define NQ_PRECISION_FIXED	2	/* 32 bit fixed point, as in Dekker's original */
+
+void nq_set_precision(nq_context *nq, int precision);
+
+/* Bytes per pixel of the picture: 1 gray, 2 gray+alpha, 3 RGB or 4 RGBA
+   (default). Other layouts are learned as the RGBA they stand for.
+   ---------------------------------------------------------------------- */
+void nq_set_channels(nq_context *nq, unsigned int channels);
+
+/* For a picture rounded from more bits per sample: what each of its bytes
+   is off by, in 256ths of a level, laid out as the picture itself. learn()
+   then trains on the samples as they were. NULL (default) for none.
+   ---------------------------------------------------------------------- */
+void nq_set_fraction(nq_context *nq, const signed char *fraction);
+
 /* Initialise network in range (0,0,0,0) to (255,255,255,255) and set parameters
    ----------------------------------------------------------------------- */
-void initnet(unsigned char *thepic, unsigned int len, unsigned int colours, double gamma);
-		
-/* Unbias network to give byte values 0..255 and record position i to prepare for sort
-   ----------------------------------------------------------------------------------- */
-static inline double biasvalue(unsigned int temp);
+void initnet(nq_context *nq, unsigned char *thepic, size_t len, unsigned int colours, double gamma);
 
 /* Output colour map
    ----------------- */
-void getcolormap(unsigned char *map);
+void getcolormap(const nq_context *nq, unsigned char *map);
 
 /* Insertion sort of network and building of netindex[0..255] (to do after unbias)
    ------------------------------------------------------------------------------- */
-void inxbuild();
+void inxbuild(nq_context *nq);
+
+/* Colour lookup used by inxsearch(). The netindex walks outwards from the
+   entries nearest in green; the k-d tree and the exhaustive SIMD search
+   always find the same colour as slowinxsearch() and do not slow down for
+   palettes with little spread in green. The exhaustive search is the
+   fastest for small palettes.
+   ----------------------------------------------------------------------- */
+#define NQ_SEARCH_NETINDEX	0	/* default */
+#define NQ_SEARCH_KDTREE	1
+#define NQ_SEARCH_BRUTE		2
+
+void nq_set_search(nq_context *nq, int search);
 
 /* Search for ABGR values 0..255 (after net is unbiased) and return colour index
    ---------------------------------------------------------------------------- */
-unsigned int inxsearch( int al,  int b,  int g,  int r);
-unsigned int slowinxsearch( int al, int b, int g, int r);
+unsigned int inxsearch(const nq_context *nq, int al, int b, int g, int r);
+unsigned int slowinxsearch(const nq_context *nq, int al, int b, int g, int r);
 
 /* Main Learning Loop
    ------------------ */
-void learn(unsigned int samplefactor, unsigned int verbose);
+void learn(nq_context *nq, unsigned int samplefactor, unsigned int verbose);
 
 /* Program Skeleton
    ----------------
    	[select samplefac in range 1..30]
    	pic = (unsigned char*) malloc(4*width*height);
    	[read image from input file into pic]
-	initnet(pic,4*width*height,samplefac,colors);
-	learn();
-	unbiasnet();
-	[write output image header, using writecolourmap(f),
+	nq = nq_create();
+	initnet(nq,pic,4*width*height,colors,gamma);
+	learn(nq,samplefac,verbose);
+	inxbuild(nq);
+	[write output image header, using getcolormap(nq,map),
 	possibly editing the loops in that function]
-	inxbuild();
-	[write output image using inxsearch(a,b,g,r)]		*/
+	[write output image using inxsearch(nq,a,b,g,r)]
+	nq_destroy(nq);						*/
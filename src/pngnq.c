@@ -47,18 +47,35 @@
 
 #define FNMAX 1024
 #define PNGNQ_USAGE "\
-Usage:  pngnq [-fhvV][-d dir][-e ext.][-g gamma][-n colours][-Q dither][-s speed][input files]\n\
+Usage:  pngnq [-fhTvV][-d dir][-e ext.][-g gamma][-j jobs][-m pixels][-n colours][-P order][-Q dither][-s speed][-S search][-t precision][-w bits][-z level][-Z strategy][input files]\n\
 Options:\n\
    -n Number of colours the quantized image is to contain. Range: 16 to 256. Defaults to 256.\n\
    -d Directory to put quantized images into.\n\
    -e Specify the new extension for quantized files. Default -nq8.png\n\
    -f Force ovewriting of files.\n\
    -g Image gamma. 1.0 = linear, 2.2 = monitor gamma. Defaults to 1.8.\n\
-   -h Print this help.\n\n\
-   -Q Quantization: n = no dithering (default), f = floyd-steinberg\n\
+   -h Print this help.\n\
+   -j Number of threads. Files are quantized in parallel, spare threads\n\
+      remap or dither each image. Defaults to 1.\n\n\
+   -m Stream the image in two passes instead of holding it in memory,\n\
+      training on a random sample of this many pixels.\n\
+   -P Palette order within the transparent and the opaque entries:\n\
+      n = as trained (default), l = by luminance, a = colours that are\n\
+      often adjacent get nearby indices, which helps row filters (-T).\n\
+   -Q Quantization: n = no dithering (default), f = floyd-steinberg,\n\
+      o = ordered dithering\n\
    -s Speed/quality: 1 = slow, best quality, 3 = good quality, 10 = fast, lower quality.\n\
+   -S Palette search: b = exhaustive, exact (default), k = k-d tree, exact,\n\
+      n = green index, as in pngnq 1.1.\n\
+   -t Training arithmetic: d = double (default), f = float, i = fixed point.\n\
+   -T Try several zlib strategies, row filters and bit depths, on -j\n\
+      threads, and write the smallest result.\n\
    -v Verbose mode. Prints status messages.\n\
    -V Print version number and library versions.\n\
+   -w zlib window, 8 to 15 bits. Defaults to libpng's choice.\n\
+   -z zlib level, 0 to 9, or a = 9 for images of up to a megapixel, 6\n\
+      for larger ones. Defaults to 9.\n\
+   -Z zlib strategy: d = default, f = filtered, h = Huffman only, r = RLE.\n\
    input files: The png files to be processed. Defaults to standard input if not specified.\n\n\
 \
   Quantizes a 32-bit RGBA PNG image to an 8 bit RGBA palette PNG\n\
@@ -78,6 +95,10 @@ Options:\n\
 #  include "../freegetopt/getopt.h"
 #endif
 
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 #if HAVE_VALGRIND_H
 # include <valgrind.h>
 #endif
@@ -95,21 +116,54 @@ Options:\n\
 #endif  
 
 #include "png.h"
+#include <zlib.h>
 #include "neuquant32.h"
 #include "rwpng.h"
+#include "quantize.h"
 #include "errors.h"
 
-typedef struct {
-  uch r, g, b, a;
-} pixel;
-
-/* Image information struct */
-static mainprog_info rwpng_info;
-
 
 static int pngnq(char* filename, char* newext, char* dir,
 		 int sample_factor, int n_colors, int verbose,  
-		 int using_stdin, int force, int use_floyd, double force_gamma);
+		 int using_stdin, int force, int use_floyd, double force_gamma,
+		 int precision, int search, int n_threads, size_t stream_pixels,
+		 const rwpng_zlib *zlib, int trials, int palette_order);
+
+#if HAVE_PTHREAD_H
+/* Work list shared by the threads of a parallel (-j) run */
+typedef struct {
+  char **files;			/* input file names */
+  int n_files;
+  char *newext;			/* settings passed on to pngnq() */
+  char *newdir;
+  int sample_factor;
+  int n_colours;
+  int verbose;
+  int force;
+  int use_floyd;
+  double force_gamma;
+  int precision;
+  int search;
+  int file_threads;		/* threads each file may use for remapping */
+  size_t stream_pixels;
+  rwpng_zlib zlib;
+  int trials;
+  int palette_order;
+
+  pthread_mutex_t lock;		/* guards everything below */
+  pthread_cond_t file_done;
+  int next_file;		/* next file to hand out to a worker */
+  int *finished;		/* per file: result is ready */
+  int *retvals;			/* per file: return value of pngnq() */
+  char **messages;		/* per file: messages printed while processing */
+  size_t *message_lens;
+} batch_info;
+
+static int pngnq_parallel(batch_info *batch, int n_threads);
+#endif
+
+static int write_smallest(mainprog_info *mainprog_ptr, int depth, FILE *outfile,
+                          const char *outname, int n_threads, int verbose);
 
 int main(int argc, char** argv)
 {
@@ -120,6 +174,7 @@ int main(int argc, char** argv)
   char *input_file_name = NULL;
   char *output_file_extension = "-nq8.png";
   char *output_directory = NULL;
+  char *end; /* of a number option */
 
   int using_stdin = FALSE;
   int c; /* argument character */
@@ -128,11 +183,19 @@ int main(int argc, char** argv)
   int retval;
   int n_colours = 256; /* number of colours to quantize to. Default 256 */
   int use_floyd = 0;
+  int n_threads = 1; /* number of files to process at once */
+  int parallel_done = FALSE;
 
   double force_gamma = 0;
+  int precision = NQ_PRECISION_DOUBLE; /* arithmetic used for training */
+  int search = NQ_SEARCH_BRUTE; /* palette lookup while remapping */
+  size_t stream_pixels = 0; /* sample size when streaming, 0 to read whole images */
+  rwpng_zlib zlib = { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 0, 0 }; /* deflate of the output */
+  int trials = FALSE; /* try several encodings, keep the smallest */
+  int palette_order = ORDER_NONE; /* of the entries within each tRNS group */
 
   /* Parse arguments */
-  while((c = getopt(argc,argv,"hVvfn:s:d:e:g:Q:"))!=-1){
+  while((c = getopt(argc,argv,"hVvfTn:s:d:e:g:j:m:P:Q:t:S:w:z:Z:"))!=-1){
     switch(c){
     case 's':
       sample_factor = atoi(optarg);
@@ -143,6 +206,9 @@ int main(int argc, char** argv)
     case 'f':
       force = 1;
       break;
+    case 'T':
+      trials = TRUE;
+      break;
     case 'V':
       verbose = 1;
       PNGNQ_MESSAGE("pngnq %s\n",PNGNQ_VERSION);
@@ -171,11 +237,63 @@ int main(int argc, char** argv)
             force_gamma=1.0;
         }
       break; 
+    case 'j':
+      n_threads = atoi(optarg);
+      if(n_threads < 1){
+	      PNGNQ_WARNING("  -j option requested %d jobs. Using one.\n",n_threads);
+	      n_threads = 1;
+      }
+      break;
+    case 'm':
+      stream_pixels = strtoul(optarg, &end, 10);
+      if(strchr(optarg, '-') || end == optarg || *end){
+	      PNGNQ_WARNING("  -m option requested a sample of %s pixels. Reading images whole.\n",optarg);
+	      stream_pixels = 0;
+      }
+      break;
+    case 'P':
+      if (optarg[0] == 'n') palette_order = ORDER_NONE;
+         else if (optarg[0] == 'l') palette_order = ORDER_LUMINANCE;
+         else if (optarg[0] == 'a') palette_order = ORDER_NEIGHBOURS;
+            else PNGNQ_WARNING("There's no palette order %s\n",optarg);
+      break;
     case 'Q':
-      if (optarg[0] == 'f') use_floyd = 1;
-         else if (optarg[0] == 'n') use_floyd = 0;
+      if (optarg[0] == 'f') use_floyd = QUANT_FLOYD;
+         else if (optarg[0] == 'o') use_floyd = QUANT_ORDERED;
+         else if (optarg[0] == 'n') use_floyd = QUANT_NONE;
             else PNGNQ_WARNING("There's no quantization method %s\n",optarg);
       break;
+    case 't':
+      if (optarg[0] == 'd') precision = NQ_PRECISION_DOUBLE;
+         else if (optarg[0] == 'f') precision = NQ_PRECISION_FLOAT;
+            else if (optarg[0] == 'i') precision = NQ_PRECISION_FIXED;
+               else PNGNQ_WARNING("There's no training precision %s\n",optarg);
+      break;
+    case 'S':
+      if (optarg[0] == 'k') search = NQ_SEARCH_KDTREE;
+         else if (optarg[0] == 'b') search = NQ_SEARCH_BRUTE;
+         else if (optarg[0] == 'n') search = NQ_SEARCH_NETINDEX;
+            else PNGNQ_WARNING("There's no palette search %s\n",optarg);
+      break;
+    case 'z':
+      if (optarg[0] == 'a') zlib.level = RWPNG_ZLIB_AUTO;
+         else if (optarg[0] >= '0' && optarg[0] <= '9' && !optarg[1]) zlib.level = optarg[0] - '0';
+            else PNGNQ_WARNING("There's no zlib level %s\n",optarg);
+      break;
+    case 'Z':
+      if (optarg[0] == 'd') zlib.strategy = Z_DEFAULT_STRATEGY;
+         else if (optarg[0] == 'f') zlib.strategy = Z_FILTERED;
+         else if (optarg[0] == 'h') zlib.strategy = Z_HUFFMAN_ONLY;
+         else if (optarg[0] == 'r') zlib.strategy = Z_RLE;
+            else PNGNQ_WARNING("There's no zlib strategy %s\n",optarg);
+      break;
+    case 'w':
+      zlib.window_bits = atoi(optarg);
+      if(zlib.window_bits < 8 || zlib.window_bits > 15){
+	      PNGNQ_WARNING("  -w option requested a %s bit window. Using 15.\n",optarg);
+	      zlib.window_bits = 15;
+      }
+      break;
     case 'd':
       output_directory = optarg;
       break;
@@ -192,6 +310,42 @@ int main(int argc, char** argv)
   PNGNQ_MESSAGE("Using quantization method %d", use_floyd);
   
 
+#if HAVE_PTHREAD_H
+  if(n_threads > 1 && argc - optind > 1){
+    batch_info batch;
+
+    batch.files = argv + optind;
+    batch.n_files = file_count = argc - optind;
+    batch.newext = output_file_extension;
+    batch.newdir = output_directory;
+    batch.sample_factor = sample_factor;
+    batch.n_colours = n_colours;
+    batch.verbose = verbose;
+    batch.force = force;
+    batch.use_floyd = use_floyd;
+    batch.force_gamma = force_gamma;
+    batch.precision = precision;
+    batch.search = search;
+    batch.stream_pixels = stream_pixels;
+    batch.zlib = zlib;
+    batch.trials = trials;
+    batch.palette_order = palette_order;
+    batch.file_threads = MAX(1, n_threads / MIN(n_threads, batch.n_files));
+
+    errors = pngnq_parallel(&batch, MIN(n_threads, batch.n_files));
+    if(errors >= 0){
+      parallel_done = TRUE;
+    }else{
+      PNGNQ_WARNING("  Cannot start parallel jobs, processing files one at a time.\n");
+      errors = file_count = 0;
+    }
+  }
+#else
+  if(n_threads > 1){
+    PNGNQ_WARNING("  Compiled without thread support, ignoring -j option.\n");
+  }
+#endif
+
   /* determine input files */
   if(optind == argc){
     using_stdin = TRUE;
@@ -203,13 +357,15 @@ int main(int argc, char** argv)
   }
 		
   /* Process each input file */
-  while(optind<=argc)
+  while(!parallel_done && optind<=argc)
   {
    
     PNGNQ_MESSAGE("  quantizing: %s \n",input_file_name);
 		
     retval = pngnq(input_file_name, output_file_extension, output_directory,
-		   sample_factor, n_colours, verbose, using_stdin,force,use_floyd,force_gamma);
+		   sample_factor, n_colours, verbose, using_stdin,force,use_floyd,force_gamma,
+		   precision, search, n_threads, stream_pixels, &zlib, trials,
+		   palette_order);
 
     if(retval){
       errors++;
@@ -235,6 +391,118 @@ int main(int argc, char** argv)
 }
 
 
+#if HAVE_PTHREAD_H
+/* Worker thread: takes files off the shared list until none are left */
+static void *batch_worker(void *arg)
+{
+  batch_info *batch = (batch_info *)arg;
+  int verbose = batch->verbose;
+  int n, retval;
+  char *message;
+  size_t message_len;
+
+  for(;;){
+    pthread_mutex_lock(&batch->lock);
+    n = batch->next_file++;
+    pthread_mutex_unlock(&batch->lock);
+    if(n >= batch->n_files)
+      break;
+
+    message = NULL;
+    message_len = 0;
+    thread_msgout = open_memstream(&message, &message_len);
+
+    PNGNQ_MESSAGE("  quantizing: %s \n",batch->files[n]);
+
+    retval = pngnq(batch->files[n], batch->newext, batch->newdir,
+		   batch->sample_factor, batch->n_colours, verbose, FALSE,
+		   batch->force, batch->use_floyd, batch->force_gamma,
+		   batch->precision, batch->search, batch->file_threads,
+		   batch->stream_pixels, &batch->zlib, batch->trials,
+		   batch->palette_order);
+
+    if(thread_msgout){
+      fclose(thread_msgout);
+      thread_msgout = NULL;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->retvals[n] = retval;
+    batch->messages[n] = message;
+    batch->message_lens[n] = message_len;
+    batch->finished[n] = TRUE;
+    pthread_cond_signal(&batch->file_done);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+/* Quantizes all files of the batch using n_threads worker threads.
+   Messages are printed and errors counted in input file order.
+   Returns the number of files that failed, or -1 if nothing was done. */
+static int pngnq_parallel(batch_info *batch, int n_threads)
+{
+  pthread_t *threads;
+  int i, started = 0, errors = 0;
+
+  threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+  batch->finished = (int *)calloc(batch->n_files, sizeof(int));
+  batch->retvals = (int *)calloc(batch->n_files, sizeof(int));
+  batch->messages = (char **)calloc(batch->n_files, sizeof(char *));
+  batch->message_lens = (size_t *)calloc(batch->n_files, sizeof(size_t));
+  batch->next_file = 0;
+
+  if (!threads || !batch->finished || !batch->retvals ||
+      !batch->messages || !batch->message_lens) {
+    errors = -1;
+    goto cleanup;
+  }
+
+  pthread_mutex_init(&batch->lock, NULL);
+  pthread_cond_init(&batch->file_done, NULL);
+
+  for(i = 0; i < n_threads; i++){
+    if(pthread_create(&threads[i], NULL, batch_worker, batch) == 0)
+      started++;
+  }
+  if(started == 0){
+    /* no threads available, do all the work here */
+    batch_worker(batch);
+  }
+
+  /* report results in order as they become available */
+  for(i = 0; i < batch->n_files; i++){
+    pthread_mutex_lock(&batch->lock);
+    while(!batch->finished[i])
+      pthread_cond_wait(&batch->file_done, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+
+    if(batch->messages[i]){
+      fwrite(batch->messages[i], 1, batch->message_lens[i], stderr);
+      fflush(stderr);
+      free(batch->messages[i]);
+    }
+    if(batch->retvals[i])
+      errors++;
+  }
+
+  for(i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_cond_destroy(&batch->file_done);
+  pthread_mutex_destroy(&batch->lock);
+
+cleanup:
+  free(threads);
+  free(batch->finished);
+  free(batch->retvals);
+  free(batch->messages);
+  free(batch->message_lens);
+  return errors;
+}
+#endif
+
+
 /* Creates an output file name based on the input file, extension and directory requested */
 char *createoutname(char *infilename, char* newext, char *newdir){
 
@@ -269,13 +537,15 @@ char *createoutname(char *infilename, char* newext, char *newdir){
       fn_len = strlen(infilename);
     }
 	 
-    /* add a separator to newdir if needed */
-    if(newdir && newdir[dir_len-1] != DIR_SEPARATOR_CHAR){
-      strncpy(newdir+dir_len,DIR_SEPARATOR_STR,1);
-      dir_len++;
-    }
     /* copy new directory name to output */
     strncpy(outname,newdir,dir_len);
+
+    /* add a separator if needed; newdir itself is shared between
+       threads and must not be modified */
+    if(newdir[dir_len-1] != DIR_SEPARATOR_CHAR){
+      outname[dir_len] = DIR_SEPARATOR_CHAR;
+      dir_len++;
+    }
   }
 
   if (fn_len > FNMAX-ext_len-dir_len) {
@@ -296,126 +566,145 @@ char *createoutname(char *infilename, char* newext, char *newdir){
 }
 
 
-static void remap_floyd(int cols, int rows, unsigned char map[MAXNETSIZE][4], unsigned int* remap,  uch **row_pointers, int quantization_method)
-{    
-    uch *outrow = NULL; /* Output image pixels */
-
-    int i,row;
-    #define CLAMP(a) ((a)>=0 ? ((a)<=255 ? (a) : 255)  : 0)      
-
-    /* Do each image row */
-    for ( row = 0; (ulg)row < rows; ++row ) {
-        int offset, nextoffset;
-        outrow = rwpng_info.interlaced? row_pointers[row] :
-        rwpng_info.indexed_data;
-    
-        int rederr=0;
-        int blueerr=0;
-        int greenerr=0;
-        int alphaerr=0;
-        
-        offset = row*cols*4;
-        nextoffset = offset; if (row+1<rows) nextoffset += cols*4;        
-        int increment = 4; 
-        
-        if (0)//row&1)
-        {
-            offset += cols*4 - 4;
-            nextoffset += cols*4 - 4;
-            increment = -4;
-        }
-        
-        for( i=0;i<cols;i++, offset+=increment, nextoffset+=increment)
-        {
-            int idx;
-            unsigned int floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
-            
-            idx = inxsearch(CLAMP(rwpng_info.rgba_data[offset+3] - alphaerr),
-                            CLAMP(rwpng_info.rgba_data[offset+2] - blueerr),
-                            CLAMP(rwpng_info.rgba_data[offset+1] - greenerr),
-                            CLAMP(rwpng_info.rgba_data[offset]   - rederr  ));                
-                                    
-            outrow[increment > 0 ? i : cols-i-1] = remap[idx];            
-            
-            int alpha = MAX(map[idx][3],rwpng_info.rgba_data[offset+3]);
-            int colorimp = 255 - ((255-alpha) * (255-alpha) / 255);         
-                
-            int thisrederr=(map[idx][0] -   rwpng_info.rgba_data[offset]) * colorimp   / 255; 
-            int thisblueerr=(map[idx][1] - rwpng_info.rgba_data[offset+1]) * colorimp  / 255; 
-            int thisgreenerr=(map[idx][2] -  rwpng_info.rgba_data[offset+2]) * colorimp  / 255;
-            int thisalphaerr=map[idx][3] - rwpng_info.rgba_data[offset+3];         
-            
-            rederr += thisrederr;
-            greenerr += thisblueerr;
-            blueerr +=  thisgreenerr;
-            alphaerr += thisalphaerr;
-            
-            unsigned int thiserr = (thisrederr*thisrederr + thisblueerr*thisblueerr + thisgreenerr*thisgreenerr + thisalphaerr*thisalphaerr)*2;
-             floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr;
-            
-            int L = 10;
-            while (rederr*rederr > L*L || greenerr*greenerr > L*L || blueerr*blueerr > L*L || alphaerr*alphaerr > L*L ||
-                   floyderr > thiserr || floyderr > L*L*2)
-            {            
-                rederr /=2;greenerr /=2;blueerr /=2;alphaerr /=2;
-                floyderr = rederr*rederr + greenerr*greenerr + blueerr*blueerr + alphaerr*alphaerr; 
-            }
-            
-            if (i>0)
-            {
-                rwpng_info.rgba_data[nextoffset-increment+3]=CLAMP(rwpng_info.rgba_data[nextoffset-increment+3] - alphaerr*3/16);
-                rwpng_info.rgba_data[nextoffset-increment+2]=CLAMP(rwpng_info.rgba_data[nextoffset-increment+2] - blueerr*3/16 );
-                rwpng_info.rgba_data[nextoffset-increment+1]=CLAMP(rwpng_info.rgba_data[nextoffset-increment+1] - greenerr*3/16);
-                rwpng_info.rgba_data[nextoffset-increment]  =CLAMP(rwpng_info.rgba_data[nextoffset-increment]   - rederr*3/16  );           
-            }
-            if (i+1<cols)
-            {
-                rwpng_info.rgba_data[nextoffset+increment+3]=CLAMP(rwpng_info.rgba_data[nextoffset+increment+3] - alphaerr/16); 
-                rwpng_info.rgba_data[nextoffset+increment+2]=CLAMP(rwpng_info.rgba_data[nextoffset+increment+2] - blueerr/16 ); 
-                rwpng_info.rgba_data[nextoffset+increment+1]=CLAMP(rwpng_info.rgba_data[nextoffset+increment+1] - greenerr/16);
-                rwpng_info.rgba_data[nextoffset+increment]  =CLAMP(rwpng_info.rgba_data[nextoffset+increment]   - rederr/16  );           
-            }
-            rwpng_info.rgba_data[nextoffset+3]=CLAMP(rwpng_info.rgba_data[nextoffset+3] - alphaerr*5/16); 
-            rwpng_info.rgba_data[nextoffset+2]=CLAMP(rwpng_info.rgba_data[nextoffset+2] - blueerr*5/16 ); 
-            rwpng_info.rgba_data[nextoffset+1]=CLAMP(rwpng_info.rgba_data[nextoffset+1] - greenerr*5/16);
-            rwpng_info.rgba_data[nextoffset]  =CLAMP(rwpng_info.rgba_data[nextoffset]   - rederr*5/16  );                   
-        }
-        
-        rederr = rederr*7/16; greenerr =greenerr*7/16; blueerr =blueerr*7/16; alphaerr =alphaerr*7/16; 
-      
-        /* if non-interlaced PNG, write row now */
-        if (!rwpng_info.interlaced)
-            rwpng_write_image_row(&rwpng_info);
-    }
-    
+/* Encodings tried by -T */
+static const struct {
+  int strategy;
+  int filters;
+  const char *name;
+} trial_encodings[] = {
+  { Z_DEFAULT_STRATEGY, PNG_FILTER_NONE, "default strategy, no filtering" },
+  { Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS, "default strategy, adaptive filtering" },
+  { Z_FILTERED, PNG_FILTER_NONE, "filtered strategy, no filtering" },
+  { Z_FILTERED, PNG_ALL_FILTERS, "filtered strategy, adaptive filtering" },
+  { Z_RLE, PNG_FILTER_NONE, "RLE strategy, no filtering" },
+  { Z_RLE, PNG_ALL_FILTERS, "RLE strategy, adaptive filtering" }
+};
+#define N_TRIALS (sizeof(trial_encodings) / sizeof(trial_encodings[0]))
+
+/* Each encoding is tried on the image packed to fewer bits per pixel, if
+   the palette is small enough, and on the image with a byte per pixel */
+typedef struct {
+  const mainprog_info *image[2];	/* packed and byte per pixel, or the same twice */
+  mainprog_info trial[2*N_TRIALS];	/* one encoding each, into out_buf */
+  unsigned int n_trials;
+  unsigned int next;		/* next trial to hand out, atomic */
+} trial_set;
+
+/* Encodes the image into memory with the trial encodings that are left */
+static void *trial_worker(void *arg)
+{
+  trial_set *ts = (trial_set *)arg;
+  mainprog_info *t;
+  unsigned int i;
+
+  while ((i = __atomic_fetch_add(&ts->next, 1, __ATOMIC_RELAXED)) < ts->n_trials) {
+    t = &ts->trial[i];
+    memcpy(t, ts->image[i / N_TRIALS], sizeof(*t));
+    t->zlib.strategy = trial_encodings[i % N_TRIALS].strategy;
+    t->zlib.filters = trial_encodings[i % N_TRIALS].filters;
+    if (rwpng_write_image_init_mem(t) == 0)
+      rwpng_write_image_whole(t);
+  }
+  return NULL;
 }
 
-static void remap_simple(unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4], unsigned int* remap,  uch **row_pointers)
+/* Encodes the indexed image of mainprog_ptr, a byte per pixel in its
+   row_pointers, in each of the trial encodings, both as it is and packed
+   to depth bits per pixel if that is less, n_threads at a time, and
+   writes the smallest to outfile. Says which one that was. Returns 0 or
+   an error code. */
+static int write_smallest(mainprog_info *mainprog_ptr, int depth, FILE *outfile,
+                          const char *outname, int n_threads, int verbose)
 {
-    uch *outrow = NULL; /* Output image pixels */
-    
-    unsigned int i,row;
-    /* Do each image row */
-    for ( row = 0; (ulg)row < rows; ++row ) 
-    {
-        unsigned int offset;
-        outrow = rwpng_info.interlaced? row_pointers[row] :
-        rwpng_info.indexed_data;
-        /* Assign the new colors */
-        offset = row*cols*4;
-        for( i=0;i<cols;i++){
-            outrow[i] = remap[inxsearch(rwpng_info.rgba_data[i*4+offset+3],
-                                        rwpng_info.rgba_data[i*4+offset+2],
-                                        rwpng_info.rgba_data[i*4+offset+1],
-                                        rwpng_info.rgba_data[i*4+offset])];
-        }
-        
-        /* if non-interlaced PNG, write row now */
-        if (!rwpng_info.interlaced)
-            rwpng_write_image_row(&rwpng_info);
-    }
-    
-    
+  trial_set *ts;
+  mainprog_info packed;
+  uch *packed_data = NULL;
+  uch **packed_rows = NULL;
+  size_t cols = mainprog_ptr->width;
+  unsigned int i, row, best;
+  int retval = 0;
+#if HAVE_PTHREAD_H
+  pthread_t threads[2*N_TRIALS];
+  int started = 0;
+#endif
+
+  if ((ts = (trial_set *)calloc(1, sizeof(trial_set))) == NULL) {
+    PNGNQ_ERROR("  Insufficient memory for trial encodings\n");
+    return 17;
+  }
+  ts->image[0] = ts->image[1] = mainprog_ptr;
+  ts->n_trials = N_TRIALS;
+
+  /* a packed copy goes first, so it wins ties. Gray levels of fewer bits
+     are not the same numbers in 8, so a gray image is only tried packed. */
+  if (depth < 8) {
+    packed_data = (uch *)malloc(mainprog_ptr->height * cols);
+    packed_rows = (uch **)malloc(mainprog_ptr->height * sizeof(uch *));
+    if (packed_data && packed_rows) {
+      for (row = 0; row < mainprog_ptr->height; row++) {
+        packed_rows[row] = packed_data + row * cols;
+        memcpy(packed_rows[row], mainprog_ptr->row_pointers[row], cols);
+      }
+      pack_rows(packed_rows, cols, mainprog_ptr->height, depth);
+      memcpy(&packed, mainprog_ptr, sizeof(packed));
+      packed.row_pointers = packed_rows;
+      packed.sample_depth = depth;
+      ts->image[0] = ts->image[1] = &packed;
+      if (!mainprog_ptr->gray) {
+        ts->image[1] = mainprog_ptr;
+        ts->n_trials = 2*N_TRIALS;
+      }
+    } else if (mainprog_ptr->gray) {
+      PNGNQ_ERROR("  Insufficient memory for trial encodings\n");
+      free(packed_rows);
+      free(packed_data);
+      free(ts);
+      return 17;
+    } else
+      PNGNQ_WARNING("  Insufficient memory to try packed pixels\n");
+  }
+  best = ts->n_trials;
+
+#if HAVE_PTHREAD_H
+  while (started < MIN(n_threads, (int)ts->n_trials) - 1 &&
+         pthread_create(&threads[started], NULL, trial_worker, ts) == 0)
+    started++;
+#endif
+  trial_worker(ts);
+#if HAVE_PTHREAD_H
+  while (started > 0)
+    pthread_join(threads[--started], NULL);
+#endif
+
+  /* the first of equally small ones wins, so the choice does not depend on timing */
+  for (i = 0; i < ts->n_trials; i++) {
+    if (ts->trial[i].retval)
+      continue;
+    PNGNQ_MESSAGE("  %s, %d bit: %lu bytes\n", trial_encodings[i % N_TRIALS].name,
+                  ts->trial[i].sample_depth, (unsigned long)ts->trial[i].out_size);
+    if (best == ts->n_trials || ts->trial[i].out_size < ts->trial[best].out_size)
+      best = i;
+  }
+
+  if (best == ts->n_trials) {
+    PNGNQ_ERROR("  No encoding of %s succeeded\n", outname);
+    retval = ts->trial[0].retval;
+  } else if (fwrite(ts->trial[best].out_buf, 1, ts->trial[best].out_size, outfile) != ts->trial[best].out_size ||
+             fflush(outfile) != 0) {
+    PNGNQ_ERROR("  Cannot write %s\n", outname);
+    retval = 16;
+  } else {
+    fprintf(PNGNQ_MSGOUT, "  %s: %s, %d bit, %lu bytes\n", outname, trial_encodings[best % N_TRIALS].name,
+            ts->trial[best].sample_depth, (unsigned long)ts->trial[best].out_size);
+    fflush(PNGNQ_MSGOUT);
+  }
+
+  for (i = 0; i < ts->n_trials; i++)
+    free(ts->trial[i].out_buf);
+  free(ts);
+  free(packed_rows);
+  free(packed_data);
+  return retval;
 }
 
 
@@ -430,26 +719,61 @@ static void set_binary_mode(FILE *fp)
 #endif
 }
 
+/* Makes the palette entries of the output from the network's colours */
+static void set_palette(mainprog_info *mainprog_ptr, unsigned char map[MAXNETSIZE][4],
+                        const unsigned int *remap, unsigned int n_colours)
+{
+  unsigned int x;
+
+  for (x = 0; x < n_colours; ++x) {
+    mainprog_ptr->palette[remap[x]].red  = map[x][0];
+    mainprog_ptr->palette[remap[x]].green = map[x][1];
+    mainprog_ptr->palette[remap[x]].blue = map[x][2];
+    mainprog_ptr->trans[remap[x]] = map[x][3];
+  }
+}
+
 static int pngnq(char* filename, char* newext, char* newdir, 
 		 int sample_factor, int n_colours, int verbose, 
-		 int using_stdin, int force, int quantization_method, double force_gamma)
+		 int using_stdin, int force, int quantization_method, double force_gamma,
+		 int precision, int search, int n_threads, size_t stream_pixels,
+		 const rwpng_zlib *zlib, int trials, int palette_order)
 {
   char *outname = NULL;
   FILE *infile = NULL;
   FILE *outfile = NULL;
 
-  int bot_idx, top_idx; /* for remapping of indices */
   unsigned int remap[MAXNETSIZE];
 
   ulg cols, rows;
   ulg row;
   unsigned char map[MAXNETSIZE][4];
-  int x;
   uch **row_pointers=NULL; /* Pointers to rows of pixels */
-  int newcolors = n_colours;
+  int keep_image;	/* all of the output is mapped before writing it */
+  int depth;		/* bits per pixel of the output */
+  unsigned int newcolors, num_trans;
+  nq_context *nq = NULL;
+  exact_palette exact;
+  int use_exact;
+  int retval;
+
+  /* Streaming: the image is read twice, one row at a time */
+  int streaming = FALSE;
+  pixel_reservoir sample;
+  mainprog_info in_info;	/* reads the second pass */
+  uch *train_data;		/* what neuquant learns from */
+  size_t train_pixels;
 
   double file_gamma;
   double quantization_gamma;
+
+  /* Image information struct, one per file so that files can be
+     processed concurrently */
+  mainprog_info rwpng_info;
+  memset(&rwpng_info, 0, sizeof(rwpng_info));
+  memset(&sample, 0, sizeof(sample));
+  memset(&in_info, 0, sizeof(in_info));
+  rwpng_info.native = in_info.native = TRUE;	/* no expanding pixels to RGBA */
     
   if(using_stdin)
   {	
@@ -466,14 +790,33 @@ static int pngnq(char* filename, char* newext, char* newdir,
   }
   
   /* Read input file */
-  rwpng_read_image(infile, &rwpng_info);
+  if (stream_pixels && using_stdin) {
+    PNGNQ_WARNING("  Cannot stream standard input, reading all of it.\n");
+    stream_pixels = 0;
+  }
+  /* 16 bit samples are kept to train on and dither from when the image
+     is read whole */
+  rwpng_info.keep_16 = !stream_pixels;
+  if (stream_pixels) {
+    if (rwpng_read_image_init(infile, &rwpng_info) == 0) {
+      if (rwpng_info.interlaced) {
+        PNGNQ_WARNING("  Cannot stream an interlaced image, reading all of it.\n");
+        rwpng_read_image_whole(&rwpng_info);
+      } else {
+        streaming = TRUE;
+        if (sample_stream(&rwpng_info, &sample, stream_pixels, &exact, &use_exact, n_colours) != 0 &&
+            !rwpng_info.retval)
+          rwpng_info.retval = 24;	/* fails the file below */
+      }
+    }
+  } else
+    rwpng_read_image(infile, &rwpng_info);
   if (!using_stdin)
     fclose(infile);
 
   if (rwpng_info.retval) {
     PNGNQ_ERROR("  rwpng_read_image() error: %d\n", rwpng_info.retval);
-    if (!using_stdin)
-      fclose(outfile);
+    free(sample.pixels);
     return(rwpng_info.retval); 
   }
   
@@ -503,8 +846,10 @@ static int pngnq(char* filename, char* newext, char* newdir,
 
   cols = rwpng_info.width;
   rows = rwpng_info.height;
+  train_data = streaming ? sample.pixels : rwpng_info.rgba_data;
+  train_pixels = streaming ? sample.n_pixels : (size_t)rows*cols;
 
-  if(!rwpng_info.rgba_data)
+  if(!train_data)
     {
        PNGNQ_WARNING("  no pixel data found.");
     }
@@ -535,79 +880,84 @@ static int pngnq(char* filename, char* newext, char* newdir,
      else { 
        PNGNQ_MESSAGE("Assuming gamma %1.4f (1/%1.1f)\n",quantization_gamma,1.0/quantization_gamma);   
        }     
-    
-    if (sample_factor<1)
-    {
-        sample_factor = 1 + rows*cols / (512*512);
-        if (sample_factor > 10) sample_factor = 10;
-        
-        if (sample_factor > 1)
-        {
-	    PNGNQ_MESSAGE("Sampling 1//%d of image\n", sample_factor);
-        }
-    }
-    
-
-  /* Start neuquant */
-  initnet((unsigned char*)rwpng_info.rgba_data,rows*cols*4,newcolors,quantization_gamma);
-  learn(sample_factor,verbose);
-  inxbuild(); 
-  getcolormap((unsigned char*)map);
-
-  /* Remap indexes so all tRNS chunks are together */
-  PNGNQ_MESSAGE("  Remapping colormap to eliminate opaque tRNS-chunk entries...\n");
-  
-  for (top_idx = newcolors-1, bot_idx = x = 0;  x < newcolors;  ++x) {
-    if (map[x][3] == 255) /* maxval */
-      remap[x] = top_idx--;
-    else
-      remap[x] = bot_idx++;
-  }
-  
-  PNGNQ_MESSAGE( "%d entr%s left\n", bot_idx,(bot_idx == 1)? "y" : "ies");
-  
 
-  /* sanity check:  top and bottom indices should have just crossed paths */
-  if (bot_idx != top_idx + 1) {
-    PNGNQ_WARNING("  Internal logic error: remapped bot_idx = %d, top_idx = %d\n",bot_idx, top_idx);
+  /* An image that already fits in the palette is kept exactly as it is */
+  if (!streaming)
+    use_exact = rwpng_info.rgba_data &&
+      find_exact_palette(&exact, rwpng_info.rgba_data, rwpng_info.channels, (size_t)rows*cols, n_colours);
+
+  retval = quantize_palette(train_data, streaming ? NULL : rwpng_info.frac_data, train_pixels,
+                            rwpng_info.channels, use_exact ? &exact : NULL,
+                            n_colours, sample_factor, quantization_gamma,
+                            precision, search, verbose, &nq,
+                            map, remap, &newcolors, &num_trans);
+  free(sample.pixels);
+  sample.pixels = NULL;
+  if (retval) {
+    if (retval == 17) {
+      PNGNQ_ERROR("  Insufficient memory for quantizer state\n");
+    }
     if (rwpng_info.row_pointers)
       free(rwpng_info.row_pointers);
     if (rwpng_info.rgba_data)
       free(rwpng_info.rgba_data);
     if (!using_stdin)
       fclose(outfile);
-    return 18;
+    return retval;
   }
 
-  rwpng_info.sample_depth = 8;
   rwpng_info.num_palette = newcolors;
-  rwpng_info.num_trans = bot_idx;
+  rwpng_info.num_trans = num_trans;
  
-  /* GRR TO DO:  if bot_idx == 0, check whether all RGB samples are gray
-     and if so, whether grayscale sample_depth would be same
-     => skip following palette section and go grayscale */
+  /* A palette of grays, with at most one fully transparent, goes out as a
+     grayscale image when that takes no more bits per pixel: there is no
+     PLTE, and pixels are their gray levels, so the order is theirs */
+  if ((depth = gray_remap(map, newcolors, remap, &num_trans, &rwpng_info.trans_gray)) != 0) {
+    PNGNQ_MESSAGE("  Writing %d bit grayscale\n", depth);
+    rwpng_info.gray = TRUE;
+    rwpng_info.num_trans = num_trans;
+    palette_order = ORDER_NONE;
+  } else
+    depth = palette_depth(newcolors);
      
   /* Remap and make palette entries */
-  for (x = 0; x < newcolors; ++x) {
-    rwpng_info.palette[remap[x]].red  = map[x][0];
-    rwpng_info.palette[remap[x]].green = map[x][1];
-    rwpng_info.palette[remap[x]].blue = map[x][2];
-    rwpng_info.trans[remap[x]] = map[x][3];
-  }
+  if (palette_order == ORDER_LUMINANCE)
+    order_by_luminance(map, newcolors, num_trans, remap);
+  set_palette(&rwpng_info, map, remap, newcolors);
  
+  /* The whole image is kept if it is interlaced, has to be encoded
+     several times or its palette is ordered by what it maps to,
+     otherwise rows are written as they are mapped */
+  if (trials && streaming) {
+    PNGNQ_WARNING("  Cannot try encodings of a streamed image, writing it once.\n");
+    trials = FALSE;
+  }
+  if (palette_order == ORDER_NEIGHBOURS && streaming) {
+    PNGNQ_WARNING("  Cannot order the palette of a streamed image by its pixels.\n");
+    palette_order = ORDER_NONE;
+  }
+  keep_image = rwpng_info.interlaced || trials || palette_order == ORDER_NEIGHBOURS;
+
+  /* Pixels are packed as tightly as the palette allows while they are
+     mapped, unless the palette is ordered by them first or -T tries both
+     packing them and not */
+  rwpng_info.sample_depth = palette_order == ORDER_NEIGHBOURS || trials ? 8 : depth;
+
   /* Allocate memory*/
-  if (rwpng_info.interlaced) {
-    if ((rwpng_info.indexed_data = (uch *)malloc(rows * cols)) != NULL) {
+  if (keep_image) {
+    if ((rwpng_info.indexed_data = (uch *)malloc((size_t)rows * cols)) != NULL) {
       if ((row_pointers = (uch **)malloc(rows * sizeof(uch *))) != NULL) 				
-        for (row = 0;  (ulg)row < rows;  ++row)
-	  row_pointers[row] = rwpng_info.indexed_data + row*cols;
+        for (row = 0;  (size_t)row < rows;  ++row)
+	  row_pointers[row] = rwpng_info.indexed_data + (size_t)row*cols;
     }
   } else rwpng_info.indexed_data = (uch *)malloc(cols);
-	
+
   if (rwpng_info.indexed_data == NULL ||
-      (rwpng_info.interlaced && row_pointers == NULL))
+      (keep_image && row_pointers == NULL))
     {
       PNGNQ_ERROR(" Insufficient memory for indexed data and/or row pointers\n");
+      nq_destroy(nq);
+      free(row_pointers);
       if (rwpng_info.row_pointers)
 	free(rwpng_info.row_pointers);
       if (rwpng_info.rgba_data)
@@ -619,9 +969,34 @@ static int pngnq(char* filename, char* newext, char* newdir,
       return 17;
     }	
 
-  /* Write headers and such. */
-  if (rwpng_write_image_init(outfile, &rwpng_info) != 0) {
+  /* Start the second pass of a streamed image */
+  if (streaming) {
+    if ((infile = fopen(filename, "rb")) == NULL ||
+        rwpng_read_image_init(infile, &in_info) != 0 ||
+        in_info.width != cols || in_info.height != rows || in_info.interlaced ||
+        in_info.channels != rwpng_info.channels) {
+      PNGNQ_ERROR("  Cannot read %s again.\n", filename);
+      if (in_info.png_ptr)
+        rwpng_read_image_finish(&in_info);
+      if (infile)
+        fclose(infile);
+      nq_destroy(nq);
+      free(rwpng_info.indexed_data);
+      if (!using_stdin)
+        fclose(outfile);
+      return 14;
+    }
+  }
+
+  /* Write headers and such, now unless the whole image is kept */
+  rwpng_info.zlib = *zlib;
+  if (!keep_image && rwpng_write_image_init(outfile, &rwpng_info) != 0) {
     PNGNQ_ERROR("  rwpng_write_image_init() error\n" );
+    nq_destroy(nq);
+    if (streaming) {
+      rwpng_read_image_finish(&in_info);
+      fclose(infile);
+    }
     if (rwpng_info.rgba_data)
       free(rwpng_info.rgba_data);
     if (rwpng_info.row_pointers)
@@ -634,14 +1009,32 @@ static int pngnq(char* filename, char* newext, char* newdir,
       fclose(outfile);
     return rwpng_info.retval;
   }
+  if (!keep_image)
+    PNGNQ_MESSAGE("  zlib level %d, strategy %d\n", rwpng_info.zlib.level, rwpng_info.zlib.strategy);
     
-    if (quantization_method > 0)
+    if (streaming)
     {
-        remap_floyd(cols,rows,map,remap,row_pointers, quantization_method);        
+        retval = remap_stream(&rwpng_info,&in_info,nq,use_exact ? &exact : NULL,cols,rows,map,
+                              newcolors,remap,quantization_method,verbose);
+        if (in_info.png_ptr)
+            rwpng_read_image_finish(&in_info);
+        fclose(infile);
     }
     else
-    {
-        remap_simple(cols,rows,map,remap,row_pointers);
+        retval = quantize_remap(&rwpng_info,nq,use_exact ? &exact : NULL,cols,rows,map,
+                                newcolors,remap,row_pointers,quantization_method,n_threads,verbose);
+    nq_destroy(nq);
+    nq = NULL;
+    if (retval) {
+        PNGNQ_ERROR("  Error %d while remapping the image\n", retval);
+        free(rwpng_info.rgba_data);
+        free(rwpng_info.row_pointers);
+        free(rwpng_info.indexed_data);
+        free(row_pointers);
+        if (!using_stdin)
+            fclose(outfile);
+        free(outname);
+        return retval;
     }
     
   /* now we're done with the INPUT data and row_pointers, so free 'em */
@@ -654,8 +1047,37 @@ static int pngnq(char* filename, char* newext, char* newdir,
     rwpng_info.row_pointers = NULL;
   }
 
+  if (palette_order == ORDER_NEIGHBOURS) {
+    if (order_by_neighbours(row_pointers, cols, rows, newcolors, num_trans, remap) != 0)
+      PNGNQ_WARNING("  Insufficient memory to order the palette, leaving it as it is.\n");
+    set_palette(&rwpng_info, map, remap, newcolors);
+  }
+  if (!trials && rwpng_info.sample_depth != depth) {
+    rwpng_info.sample_depth = depth;
+    pack_rows(row_pointers, cols, rows, depth);
+  }
+
+  /* Write headers of a kept image */
+  if (keep_image && !trials) {
+    if (rwpng_write_image_init(outfile, &rwpng_info) != 0) {
+      PNGNQ_ERROR("  rwpng_write_image_init() error\n" );
+      free(rwpng_info.indexed_data);
+      free(row_pointers);
+      if (!using_stdin)
+        fclose(outfile);
+      free(outname);
+      return rwpng_info.retval;
+    }
+    PNGNQ_MESSAGE("  zlib level %d, strategy %d\n", rwpng_info.zlib.level, rwpng_info.zlib.strategy);
+  }
+
   /* write entire interlaced palette PNG, or finish/flush noninterlaced one */
-  if (rwpng_info.interlaced) {
+  retval = 0;
+  if (trials) {
+    rwpng_info.row_pointers = row_pointers;
+    retval = write_smallest(&rwpng_info, depth, outfile, using_stdin ? "stdout" : outname,
+                            n_threads, verbose);
+  } else if (keep_image) {
     rwpng_info.row_pointers = row_pointers;   /* now for OUTPUT data */
     rwpng_write_image_whole(&rwpng_info);
   } else rwpng_write_image_finish(&rwpng_info);
@@ -679,7 +1101,7 @@ static int pngnq(char* filename, char* newext, char* newdir,
     outname = NULL;
   }
 
-  return 0;
+  return retval;
 }
 
 
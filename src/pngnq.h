@@ -0,0 +1,111 @@
+/* pngnq.h - libpngnq, the pngnq quantizer as a library.
+**
+** Quantizes 32 bit RGBA pixels in memory to a palette of at most 256
+** colours with the Neuquant algorithm, the way pngnq does for PNG files:
+**
+**   pngnq_context *ctx = pngnq_create();
+**   pngnq_options opt;
+**   pngnq_palette pal;
+**
+**   pngnq_options_init(&opt);
+**   opt.colours = 64;
+**   if (pngnq_quantize(ctx, rgba, width, height, &opt, &pal, indices) == PNGNQ_OK)
+**     ... pixel i is pal.rgba[indices[i]] ...
+**   pngnq_destroy(ctx);
+**
+** A context holds no more than scratch memory reused from one image to the
+** next. It may only be used by one thread at a time; threads quantizing at
+** the same time each need their own. Nothing else is shared.
+**
+** Copyright (C) 2004-2009 by Stuart Coyle
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted, provided
+** that the above copyright notice appear in all copies and that both that
+** copyright notice and this permission notice appear in supporting
+** documentation.  This software is provided "as is" without express or
+** implied warranty.
+*/
+
+#ifndef PNGNQ_H
+#define PNGNQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return values of pngnq_quantize(), which may also return the other
+   non-zero error codes of pngnq */
+#define PNGNQ_OK		0
+#define PNGNQ_ERR_ARGUMENT	1	/* bad image size or option */
+#define PNGNQ_ERR_MEMORY	17	/* out of memory */
+#define PNGNQ_ERR_INTERNAL	18	/* inconsistent palette; a bug */
+
+/* Dithering, pngnq -Q */
+#define PNGNQ_DITHER_NONE	0
+#define PNGNQ_DITHER_FLOYD	1	/* Floyd-Steinberg */
+#define PNGNQ_DITHER_ORDERED	2	/* 8x8 Bayer matrix */
+
+/* Training arithmetic, pngnq -t */
+#define PNGNQ_PRECISION_DOUBLE	0
+#define PNGNQ_PRECISION_FLOAT	1
+#define PNGNQ_PRECISION_FIXED	2
+
+/* Palette search while mapping pixels, pngnq -S */
+#define PNGNQ_SEARCH_BRUTE	0	/* exhaustive, exact */
+#define PNGNQ_SEARCH_KDTREE	1	/* k-d tree, exact */
+#define PNGNQ_SEARCH_NETINDEX	2	/* green index, as in pngnq 1.1 */
+
+/* Order of the palette within the entries that are not opaque and within
+   the opaque ones, pngnq -P */
+#define PNGNQ_ORDER_NONE	0	/* as trained */
+#define PNGNQ_ORDER_LUMINANCE	1
+#define PNGNQ_ORDER_NEIGHBOURS	2	/* adjacent colours get nearby indices */
+
+typedef struct {
+  unsigned int colours;		/* 1 to 256, default 256; pngnq -n */
+  unsigned int speed;		/* 1 best to 10 fastest, 0 (default) by image size; pngnq -s */
+  double gamma;			/* of the pixels, default 1.8; pngnq -g */
+  int dither;			/* PNGNQ_DITHER_*, default none */
+  int precision;		/* PNGNQ_PRECISION_*, default double */
+  int search;			/* PNGNQ_SEARCH_*, default brute */
+  unsigned int threads;		/* for mapping the pixels, default 1; pngnq -j */
+  int order;			/* PNGNQ_ORDER_*, default none */
+  int reserved[7];		/* for options to come, zeroed by pngnq_options_init() */
+} pngnq_options;
+
+typedef struct {
+  unsigned int count;		/* entries used */
+  unsigned int num_trans;	/* entries 0 to num_trans-1 are the ones not opaque */
+  unsigned char rgba[256][4];
+} pngnq_palette;
+
+typedef struct pngnq_context pngnq_context;
+
+/* Returns the version of the library, such as "1.1" */
+const char *pngnq_version(void);
+
+/* Sets all options to their defaults */
+void pngnq_options_init(pngnq_options *options);
+
+/* Returns a new context, or NULL when out of memory */
+pngnq_context *pngnq_create(void);
+
+/* Releases a context from pngnq_create() */
+void pngnq_destroy(pngnq_context *ctx);
+
+/* Quantizes width*height RGBA pixels, rows one after another, to a palette
+   of at most options->colours colours. An image with no more colours than
+   that keeps them exactly. Fills palette, and indices, which must have room
+   for width*height bytes, with the palette entry of each pixel. options may
+   be NULL for the defaults. Returns PNGNQ_OK or an error code. */
+int pngnq_quantize(pngnq_context *ctx, const unsigned char *rgba,
+                   unsigned int width, unsigned int height,
+                   const pngnq_options *options,
+                   pngnq_palette *palette, unsigned char *indices);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PNGNQ_H */
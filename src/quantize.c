@@ -0,0 +1,1261 @@
+/* quantize.c - chooses the palette of an image with the Neuquant
+** algorithm and maps its pixels to it, optionally dithering. This is the
+** part of pngnq that libpngnq shares.
+**
+** Copyright (C) 1989, 1991 by Jef Poskanzer.
+** Copyright (C) 1997, 2000, 2002 by Greg Roelofs; based on an idea by
+**                                Stefan Schneider.
+** Copyright (C) 2004-2009 by Stuart Coyle
+** Copyright (C) Kornel Lesiński (2009)
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted, provided
+** that the above copyright notice appear in all copies and that both that
+** copyright notice and this permission notice appear in supporting
+** documentation.  This software is provided "as is" without express or
+** implied warranty.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>	/* SIZE_MAX */
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#  include <sched.h>	/* sched_yield() */
+#endif
+
+#include "png.h"
+#include "neuquant32.h"
+#include "rwpng.h"
+#include "quantize.h"
+#include "errors.h"
+
+#if HAVE_PTHREAD_H
+__thread FILE *thread_msgout = NULL;
+#endif
+
+typedef struct {
+  uch r, g, b, a;
+} pixel;
+
+/* Most recent inxsearch() results of remap_simple(), direct mapped on the
+   packed RGBA value. Images tend to repeat the same few pixel values. */
+#define REMAP_CACHE_BITS 12		/* 4096 entries, 32k */
+#define REMAP_CACHE_SIZE (1<<REMAP_CACHE_BITS)
+
+typedef struct {
+  unsigned int rgba;
+  int index;			/* output index, -1 if empty */
+} remap_cache_entry;
+
+typedef struct {		/* per thread state of remap_simple() */
+  remap_cache_entry cache[REMAP_CACHE_SIZE];
+  unsigned long hits, misses;
+  const short *ordered;		/* ordered dither offsets, or NULL */
+  int channels;			/* of the input pixels */
+} remap_state;
+
+/* Input pixels are gray, gray+alpha, RGB or RGBA, a byte per channel, as
+   they were read; they are mapped as the RGBA they stand for. The remap
+   loops expand them a tile of this many at a time, where they are not
+   RGBA already. */
+#define PIXEL_TILE 8
+
+/* Ordered dithering adds the 8x8 Bayer matrix, scaled to the spacing of
+   the palette, to the red, green and blue of every pixel before looking it
+   up. Offsets are kept per row of the tile for 8 RGBA pixels at a time. */
+#define ORDERED_TILE 8
+
+#if HAVE_PTHREAD_H
+/* Shared state of a multithreaded remap_simple(), see remap_band_worker() */
+#define REMAP_BAND_PIXELS 65536		/* rows per band: this many pixels */
+
+typedef struct {
+  const uch *rgba_data;		/* input image */
+  const nq_context *nq;
+  const unsigned int *remap;
+  const short *ordered;		/* ordered dither offsets, or NULL */
+  unsigned int cols, rows;
+  int channels;			/* of the input pixels */
+  int depth;			/* bits per output pixel */
+  uch **row_pointers;		/* output rows, if the whole image is kept */
+  uch *window;			/* otherwise the ring of bands being remapped */
+  unsigned int band_rows, n_bands, window_bands;
+
+  pthread_mutex_t lock;		/* guards everything below */
+  pthread_cond_t changed;
+  unsigned int next_band;	/* next band to hand out */
+  unsigned int written_bands;	/* bands the writer is done with */
+  unsigned int *band_ready;	/* per window slot: band number + 1 once remapped */
+  unsigned long hits, misses;
+} remap_bands;
+
+/* Shared state of a multithreaded remap_floyd(). Each thread dithers a
+   whole row, trailing the thread on the row above, see floyd_sync(). */
+#define FLOYD_STEP 64		/* pixels between progress updates */
+#define FLOYD_LAG 2		/* pixel i of a row needs pixel i+FLOYD_LAG of the row above */
+
+typedef struct {
+  size_t done;			/* row*cols + pixels done of the slot's latest row */
+  char pad[64 - sizeof(size_t)];	/* one cache line each */
+} floyd_progress;
+
+typedef struct {
+  mainprog_info *mainprog_ptr;
+  const nq_context *nq;
+  unsigned char (*map)[4];
+  const unsigned int *remap;
+  unsigned int cols, rows;
+  uch **row_pointers;		/* output rows, if the whole image is kept */
+  uch *window;			/* otherwise one output row per slot */
+  short *err;			/* error diffused into the row, per slot */
+  floyd_progress *progress;	/* per slot, slot = row % n_slots */
+  unsigned int n_slots;		/* more than the number of threads */
+  unsigned int next_row;	/* next row to hand out, atomic */
+  unsigned int written_rows;	/* rows written to libpng, atomic */
+} floyd_wave;
+#else
+typedef void floyd_wave;
+#endif
+
+
+#if HAVE_PTHREAD_H
+/* Publishes that the first done pixels of row are dithered, then waits
+   until the row above is far enough ahead for the next FLOYD_STEP pixels.
+   Pixel i reads what the row above diffused into it from pixels i-1, i
+   and i+1, and the last row also what its own row above put into pixel
+   i+1 (it diffuses into itself), so FLOYD_LAG is 2. */
+static void floyd_sync(floyd_wave *fw, unsigned int row, unsigned int done)
+{
+    const floyd_progress *above;
+    size_t need;
+
+    __atomic_store_n(&fw->progress[row % fw->n_slots].done,
+                     (size_t)row*fw->cols + done, __ATOMIC_RELEASE);
+    if (row == 0 || done == fw->cols)
+        return;
+
+    /* the slot may already hold a later row, which implies this one is done */
+    above = &fw->progress[(row-1) % fw->n_slots];
+    need = (size_t)(row-1)*fw->cols + MIN(done + FLOYD_STEP + FLOYD_LAG, fw->cols);
+    while (__atomic_load_n(&above->done, __ATOMIC_ACQUIRE) < need)
+        sched_yield();
+}
+#endif
+
+/* Packs a row of one index per byte to depth bits each, in place, the
+   leftmost pixel in the high bits of each byte as PNG has it. Done on each
+   row as soon as it is mapped, while it is still in cache. */
+static void pack_row(uch *row, unsigned int cols, int depth)
+{
+    unsigned int i, j, per_byte;
+    uch *out = row;
+    uch byte;
+
+    if (depth >= 8)
+        return;
+    per_byte = 8 / depth;
+    for (i = 0; i + per_byte <= cols; i += per_byte) {
+        byte = 0;
+        for (j = 0; j < per_byte; j++)
+            byte = byte << depth | row[i+j];
+        *out++ = byte;
+    }
+    if (i < cols) {
+        byte = 0;
+        for (j = 0; j < per_byte; j++)
+            byte = byte << depth | (i+j < cols ? row[i+j] : 0);
+        *out = byte;
+    }
+}
+
+/* See quantize.h */
+int palette_depth(unsigned int n_colours)
+{
+    return n_colours <= 2 ? 1 : n_colours <= 4 ? 2 : n_colours <= 16 ? 4 : 8;
+}
+
+/* See quantize.h */
+int gray_remap(unsigned char map[MAXNETSIZE][4], unsigned int n_colours, unsigned int *remap,
+               unsigned int *num_trans, uch *trans_gray)
+{
+    uch used[256];
+    unsigned int x, levels, n_used;
+    int trans = FALSE, depth, step = 1, key;
+
+    for (x = 0; x < n_colours; x++) {
+        if (map[x][3] == 0)
+            trans = TRUE;	/* its colour does not matter */
+        else if (map[x][3] != 255 || map[x][0] != map[x][1] || map[x][1] != map[x][2])
+            return 0;
+    }
+
+    /* the fewest bits whose levels, spread over 0 to 255, include all the
+       grays and leave one free for the transparent pixels */
+    for (depth = 1; depth <= palette_depth(n_colours); depth *= 2) {
+        levels = 1 << depth;
+        step = 255 / (levels - 1);
+        memset(used, 0, sizeof(used));
+        for (x = 0, n_used = 0; x < n_colours; x++) {
+            if (map[x][3] == 0)
+                continue;
+            if (map[x][0] % step != 0)
+                break;
+            if (!used[map[x][0] / step]) {
+                used[map[x][0] / step] = TRUE;
+                n_used++;
+            }
+        }
+        if (x == n_colours && (!trans || n_used < levels))
+            break;
+    }
+    if (depth > palette_depth(n_colours))
+        return 0;
+
+    for (key = 0; trans && used[key]; key++)
+        ;
+    for (x = 0; x < n_colours; x++)
+        remap[x] = map[x][3] == 0 ? key : map[x][0] / step;
+    *num_trans = trans;
+    *trans_gray = trans ? key : 0;
+    return depth;
+}
+
+/* See quantize.h */
+void pack_rows(uch **row_pointers, unsigned int cols, unsigned int rows, int depth)
+{
+    unsigned int row;
+
+    for (row = 0; row < rows; row++)
+        pack_row(row_pointers[row], cols, depth);
+}
+
+/* Expands n pixels of the given number of channels to RGBA */
+static void expand_pixels(const uch *in, uch *rgba, unsigned int n, int channels)
+{
+    unsigned int i;
+
+    switch (channels) {
+    case 1:
+        for (i = 0; i < n; i++) {
+            rgba[i*4] = rgba[i*4+1] = rgba[i*4+2] = in[i];
+            rgba[i*4+3] = 255;
+        }
+        break;
+    case 2:
+        for (i = 0; i < n; i++) {
+            rgba[i*4] = rgba[i*4+1] = rgba[i*4+2] = in[i*2];
+            rgba[i*4+3] = in[i*2+1];
+        }
+        break;
+    case 3:
+        for (i = 0; i < n; i++) {
+            rgba[i*4] = in[i*3];
+            rgba[i*4+1] = in[i*3+1];
+            rgba[i*4+2] = in[i*3+2];
+            rgba[i*4+3] = 255;
+        }
+        break;
+    default:
+        memcpy(rgba, in, n*4);
+    }
+}
+
+/* Channel c, in RGBA order, of pixel i of a row of the given number of
+   channels */
+static inline int pixel_channel(const uch *row, int i, int c, int channels)
+{
+    switch (channels) {
+    case 1: return c == 3 ? 255 : row[i];
+    case 2: return row[i*2 + (c == 3)];
+    case 3: return c == 3 ? 255 : row[i*3+c];
+    default: return row[i*4+c];
+    }
+}
+
+/* Fraction of channel c of pixel i of a row of rwpng frac_data, laid out
+   as the row itself; 0 without one */
+static inline int frac_channel(const signed char *frac, int i, int c, int channels)
+{
+    if (!frac)
+        return 0;
+    switch (channels) {
+    case 1: return c == 3 ? 0 : frac[i];
+    case 2: return frac[i*2 + (c == 3)];
+    case 3: return c == 3 ? 0 : frac[i*3+c];
+    default: return frac[i*4+c];
+    }
+}
+
+#define CLAMP(a) ((a)>=0 ? ((a)<=255 ? (a) : 255)  : 0)      
+
+/* The running error e, kept in 1/unit of a level, in levels, rounded */
+#define ERR_LEVELS(e, unit) ((unit) == 1 ? (e) : (e) >= 0 ? ((e) + (unit)/2) / (unit) : -((-(e) + (unit)/2) / (unit)))
+
+/* Adds error e to the pixel of row below at column i. nexterr holds how
+   far each pixel has been moved so far; the moved pixel is clamped to the
+   valid range every time, as if the image was changed in place. */
+static void floyd_diffuse(const uch *below, int channels, short *nexterr, int i, int r, int g, int b, int a)
+{
+    int e[4] = { r, g, b, a };
+    int c, v, p;
+
+    for (c = 0; c < 4; c++) {
+        p = pixel_channel(below, i, c, channels);
+        v = p + nexterr[i*4+c] - e[c];
+        nexterr[i*4+c] = CLAMP(v) - p;
+    }
+}
+
+/* Dithers row in, diffusing its error into row below. err holds the error
+   diffused into this row, nexterr gets the error for the next one. For the
+   last row, which diffuses into itself, below is in and nexterr is err.
+   The image itself is only read. frac is the fraction of in, if it was
+   rounded from 16 bits, or NULL; the error carried along the row is then
+   kept in 256ths of a level, so that what rounding took away adds up. fw
+   is NULL when rows are done in order by one thread. */
+static void remap_floyd_row(const uch *in, const signed char *frac, const uch *below, int channels, const nq_context *nq, int cols, int row, unsigned char map[MAXNETSIZE][4], const unsigned int* remap, short *err, short *nexterr, uch *outrow, floyd_wave *fw)
+{    
+    int pixel[4];
+    int i,c;
+    const int unit = frac ? 256 : 1;
+        
+    int rederr=0;
+    int blueerr=0;
+    int greenerr=0;
+    int alphaerr=0;
+
+    if (nexterr != err)
+        memset(nexterr, 0, cols*4*sizeof(short));
+        
+    for( i=0;i<cols;i++)
+    {
+        int idx;
+#if HAVE_PTHREAD_H
+        if (fw && i % FLOYD_STEP == 0)
+            floyd_sync(fw, row, i);
+#endif
+        /* the pixel with what the row above diffused into it, in 1/unit
+           of a level */
+        for (c = 0; c < 4; c++)
+            pixel[c] = (pixel_channel(in, i, c, channels) + err[i*4+c]) * unit + frac_channel(frac, i, c, channels);
+            
+        idx = inxsearch(nq, CLAMP(ERR_LEVELS(pixel[3] - alphaerr, unit)),
+                        CLAMP(ERR_LEVELS(pixel[2] - blueerr, unit)),
+                        CLAMP(ERR_LEVELS(pixel[1] - greenerr, unit)),
+                        CLAMP(ERR_LEVELS(pixel[0] - rederr, unit)));                
+                                    
+        outrow[i] = remap[idx];            
+            
+        int alpha = MAX(map[idx][3],ERR_LEVELS(pixel[3], unit));
+        int colorimp = 255 - ((255-alpha) * (255-alpha) / 255);         
+                
+        int thisrederr=(map[idx][0]*unit -   pixel[0]) * colorimp   / 255; 
+        int thisblueerr=(map[idx][1]*unit - pixel[1]) * colorimp  / 255; 
+        int thisgreenerr=(map[idx][2]*unit -  pixel[2]) * colorimp  / 255;
+        int thisalphaerr=map[idx][3]*unit - pixel[3];         
+            
+        rederr += thisrederr;
+        greenerr += thisblueerr;
+        blueerr +=  thisgreenerr;
+        alphaerr += thisalphaerr;
+            
+        unsigned long long thiserr = ((long long)thisrederr*thisrederr + (long long)thisblueerr*thisblueerr +
+                                      (long long)thisgreenerr*thisgreenerr + (long long)thisalphaerr*thisalphaerr)*2;
+        unsigned long long floyderr = (long long)rederr*rederr + (long long)greenerr*greenerr +
+                                      (long long)blueerr*blueerr + (long long)alphaerr*alphaerr;
+            
+        long long L = 10*unit;
+        while ((long long)rederr*rederr > L*L || (long long)greenerr*greenerr > L*L ||
+               (long long)blueerr*blueerr > L*L || (long long)alphaerr*alphaerr > L*L ||
+               floyderr > thiserr || floyderr > L*L*2)
+        {            
+            rederr /=2;greenerr /=2;blueerr /=2;alphaerr /=2;
+            floyderr = (long long)rederr*rederr + (long long)greenerr*greenerr +
+                       (long long)blueerr*blueerr + (long long)alphaerr*alphaerr; 
+        }
+            
+        if (i>0)
+            floyd_diffuse(below, channels, nexterr, i-1, rederr*3/(16*unit), greenerr*3/(16*unit), blueerr*3/(16*unit), alphaerr*3/(16*unit));
+        if (i+1<cols)
+            floyd_diffuse(below, channels, nexterr, i+1, rederr/(16*unit), greenerr/(16*unit), blueerr/(16*unit), alphaerr/(16*unit));
+        floyd_diffuse(below, channels, nexterr, i, rederr*5/(16*unit), greenerr*5/(16*unit), blueerr*5/(16*unit), alphaerr*5/(16*unit));
+    }
+#if HAVE_PTHREAD_H
+    if (fw)
+        floyd_sync(fw, row, cols);
+#endif
+}
+
+/* err is two rows of cols*4 zeroed error terms */
+static void remap_floyd(mainprog_info *mainprog_ptr, const nq_context *nq, int cols, int rows, unsigned char map[MAXNETSIZE][4], unsigned int* remap,  uch **row_pointers, short *err)
+{    
+    uch *outrow = NULL; /* Output image pixels */
+    short *thiserr, *nexterr;
+    const uch *in;
+    const signed char *frac;
+    int channels = mainprog_ptr->channels;
+    int row;
+
+    /* Do each image row */
+    for ( row = 0; (size_t)row < rows; ++row ) {
+        outrow = row_pointers ? row_pointers[row] :
+        mainprog_ptr->indexed_data;
+
+        in = mainprog_ptr->rgba_data + (size_t)row*cols*channels;
+        thiserr = err + (row&1)*cols*4;
+        nexterr = row+1 < rows ? err + ((row+1)&1)*cols*4 : thiserr;
+        frac = mainprog_ptr->frac_data ? mainprog_ptr->frac_data + (size_t)row*cols*channels : NULL;
+        remap_floyd_row(in, frac, row+1 < rows ? in + cols*channels : in, channels, nq, cols, row, map, remap, thiserr, nexterr, outrow, NULL);
+        pack_row(outrow, cols, mainprog_ptr->sample_depth);
+      
+        /* unless the whole image is kept, write row now */
+        if (!row_pointers)
+            rwpng_write_image_row(mainprog_ptr);
+    }
+}
+
+#if HAVE_PTHREAD_H
+/* Threads take the next row to dither as they become free. Rows finish in
+   order, so with n_slots more than the number of threads a row's slot, and
+   the error row it fills for the row below, are free again by the time it
+   is handed out. Each thread writes its own row
+   to libpng once the row above has been written. */
+static void *remap_floyd_worker(void *arg)
+{
+    floyd_wave *fw = (floyd_wave *)arg;
+    mainprog_info *mainprog_ptr = fw->mainprog_ptr;
+    unsigned int row;
+    uch *outrow;
+    const uch *in;
+    const signed char *frac;
+    short *err, *nexterr;
+    int channels = mainprog_ptr->channels;
+
+    /* Taking a row clears the error slot of the row below, which the
+       thread that had that slot last read as its own; acquire-release on
+       next_row orders the two, releasing a thread's rows as it takes the
+       next one. */
+    while ((row = __atomic_fetch_add(&fw->next_row, 1, __ATOMIC_ACQ_REL)) < fw->rows) {
+        outrow = fw->row_pointers ? fw->row_pointers[row] :
+            fw->window + (size_t)(row % fw->n_slots) * fw->cols;
+        err = fw->err + (size_t)(row % fw->n_slots) * fw->cols * 4;
+        nexterr = row+1 < fw->rows ? fw->err + (size_t)((row+1) % fw->n_slots) * fw->cols * 4 : err;
+
+        in = mainprog_ptr->rgba_data + (size_t)row * fw->cols * channels;
+
+        frac = mainprog_ptr->frac_data ? mainprog_ptr->frac_data + (size_t)row * fw->cols * channels : NULL;
+
+        remap_floyd_row(in, frac, row+1 < fw->rows ? in + fw->cols * channels : in, channels, fw->nq, fw->cols, row, fw->map, fw->remap, err, nexterr, outrow, fw);
+        pack_row(outrow, fw->cols, mainprog_ptr->sample_depth);
+
+        if (!fw->row_pointers) {
+            while (__atomic_load_n(&fw->written_rows, __ATOMIC_ACQUIRE) != row)
+                sched_yield();
+            mainprog_ptr->indexed_data = outrow;
+            rwpng_write_image_row(mainprog_ptr);
+            __atomic_store_n(&fw->written_rows, row + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/* remap_floyd() on a wavefront of n_threads threads, the calling thread
+   being one of them. Gives the same output. Returns FALSE without doing
+   anything if it cannot allocate its buffers. */
+static int remap_floyd_parallel(mainprog_info *mainprog_ptr, const nq_context *nq, unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4], unsigned int* remap,  uch **row_pointers, int n_threads)
+{
+    floyd_wave fw;
+    pthread_t *threads;
+    uch *own_row = mainprog_ptr->indexed_data;
+    int i, started = 0;
+
+    memset(&fw, 0, sizeof(fw));
+    fw.mainprog_ptr = mainprog_ptr;
+    fw.nq = nq;
+    fw.map = map;
+    fw.remap = remap;
+    fw.cols = cols;
+    fw.rows = rows;
+    fw.row_pointers = row_pointers;
+    fw.n_slots = n_threads + 1;
+
+    threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+    fw.progress = (floyd_progress *)calloc(fw.n_slots, sizeof(floyd_progress));
+    fw.err = (short *)calloc((size_t)fw.n_slots * cols * 4, sizeof(short));
+    if (!row_pointers)
+        fw.window = (uch *)malloc((size_t)fw.n_slots * cols);
+    if (!threads || !fw.progress || !fw.err || (!row_pointers && !fw.window)) {
+        free(threads);
+        free(fw.progress);
+        free(fw.err);
+        free(fw.window);
+        return FALSE;
+    }
+
+    /* the rows adapt to however many threads do start */
+    for (i = 1; i < n_threads; i++) {
+        if (pthread_create(&threads[started], NULL, remap_floyd_worker, &fw) == 0)
+            started++;
+    }
+    remap_floyd_worker(&fw);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    mainprog_ptr->indexed_data = own_row;
+    free(threads);
+    free(fw.progress);
+    free(fw.err);
+    free(fw.window);
+    return TRUE;
+}
+#endif
+
+
+static const uch bayer[ORDERED_TILE][ORDERED_TILE] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/* Fills ordered[ORDERED_TILE][ORDERED_TILE*4] with the offsets for a
+   palette: the matrix spans the mean distance from each colour to its
+   nearest neighbour, about the step between palette colours. */
+static void ordered_offsets(unsigned char map[MAXNETSIZE][4], int n_colours, short *ordered)
+{
+    double spread = 0;
+    int i, j, x, y, c, d, dist, best;
+
+    for (i = 0; i < n_colours; i++) {
+        best = 3*255*255;
+        for (j = 0; j < n_colours; j++) {
+            if (j == i)
+                continue;
+            dist = 0;
+            for (c = 0; c < 3; c++) {
+                d = map[i][c] - map[j][c];
+                dist += d*d;
+            }
+            best = MIN(best, dist);
+        }
+        spread += sqrt(best);
+    }
+    if (n_colours > 1)
+        spread /= n_colours;
+
+    for (y = 0; y < ORDERED_TILE; y++)
+        for (x = 0; x < ORDERED_TILE; x++)
+            for (c = 0; c < 4; c++)
+                ordered[(y*ORDERED_TILE + x)*4 + c] = c == 3 ? 0 :
+                    floor(((bayer[y][x] + 0.5) / (ORDERED_TILE*ORDERED_TILE) - 0.5) * spread + 0.5);
+}
+
+/* Maps one row of RGBA pixels to output indices */
+static void remap_simple_row(const uch *inrow, uch *outrow, unsigned int cols, unsigned int row, const nq_context *nq, const unsigned int *remap, remap_state *st)
+{
+    unsigned int i,j,n,key,h;
+    const uch *p;
+    const short *offset = st->ordered ? st->ordered + (row % ORDERED_TILE)*ORDERED_TILE*4 : NULL;
+    uch dithered[ORDERED_TILE*4];
+    int v;
+
+    for( i=0;i<cols;i+=n){
+        n = MIN(ORDERED_TILE, cols-i);
+        p = inrow + i*st->channels;
+        if (st->channels != 4) {
+            expand_pixels(p, dithered, n, st->channels);
+            p = dithered;
+        }
+        if (offset) {
+            /* independent per byte, so this vectorizes */
+            for (j = 0; j < n*4; j++) {
+                v = p[j] + offset[j];
+                dithered[j] = CLAMP(v);
+            }
+            p = dithered;
+        }
+        for (j = 0; j < n; j++, p += 4) {
+            key = p[0] | p[1]<<8 | p[2]<<16 | (unsigned int)p[3]<<24;
+            h = (key * 0x9E3779B1u) >> (32-REMAP_CACHE_BITS);
+            if (st->cache[h].index < 0 || st->cache[h].rgba != key) {
+                st->cache[h].rgba = key;
+                st->cache[h].index = remap[inxsearch(nq, p[3], p[2], p[1], p[0])];
+                st->misses++;
+            } else st->hits++;
+            outrow[i+j] = st->cache[h].index;
+        }
+    }
+}
+
+static void remap_state_init(remap_state *st, const short *ordered, int channels)
+{
+    unsigned int h;
+
+    for (h = 0; h < REMAP_CACHE_SIZE; h++)
+        st->cache[h].index = -1;
+    st->hits = st->misses = 0;
+    st->ordered = ordered;
+    st->channels = channels;
+}
+
+static void remap_simple(mainprog_info *mainprog_ptr, const nq_context *nq, unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4], unsigned int* remap,  uch **row_pointers, const short *ordered, int verbose)
+{
+    uch *outrow = NULL; /* Output image pixels */
+    remap_state st;
+    
+    unsigned int row;
+
+    remap_state_init(&st, ordered, mainprog_ptr->channels);
+
+    /* Do each image row */
+    for ( row = 0; (size_t)row < rows; ++row ) 
+    {
+        outrow = row_pointers ? row_pointers[row] :
+        mainprog_ptr->indexed_data;
+        /* Assign the new colors */
+        remap_simple_row(mainprog_ptr->rgba_data + (size_t)row*cols*mainprog_ptr->channels, outrow, cols, row, nq, remap, &st);
+        pack_row(outrow, cols, mainprog_ptr->sample_depth);
+        
+        /* unless the whole image is kept, write row now */
+        if (!row_pointers)
+            rwpng_write_image_row(mainprog_ptr);
+    }
+    
+    PNGNQ_MESSAGE("  Remap cache: %lu hits, %lu misses\n", st.hits, st.misses);
+}
+
+#if HAVE_PTHREAD_H
+/* Worker threads take bands of rows in order and remap them. For a
+   image that is written as it goes they remap into a ring of window_bands bands, which
+   the calling thread writes out in order; workers wait for it when they get
+   too far ahead, so memory use does not grow with the image. */
+static void *remap_band_worker(void *arg)
+{
+  remap_bands *rb = (remap_bands *)arg;
+  remap_state st;
+  unsigned int band, row, first, last;
+  uch *outrow;
+
+  remap_state_init(&st, rb->ordered, rb->channels);
+  for(;;){
+    pthread_mutex_lock(&rb->lock);
+    while(rb->window && rb->next_band < rb->n_bands &&
+          rb->next_band >= rb->written_bands + rb->window_bands)
+      pthread_cond_wait(&rb->changed, &rb->lock);
+    if(rb->next_band >= rb->n_bands){
+      rb->hits += st.hits;
+      rb->misses += st.misses;
+      pthread_mutex_unlock(&rb->lock);
+      return NULL;
+    }
+    band = rb->next_band++;
+    pthread_mutex_unlock(&rb->lock);
+
+    first = band * rb->band_rows;
+    last = MIN(first + rb->band_rows, rb->rows);
+    for(row = first; row < last; row++){
+      outrow = rb->window ?
+        rb->window + ((size_t)(band % rb->window_bands) * rb->band_rows + row - first) * rb->cols :
+        rb->row_pointers[row];
+      remap_simple_row(rb->rgba_data + (size_t)row * rb->cols * rb->channels, outrow, rb->cols, row, rb->nq, rb->remap, &st);
+      pack_row(outrow, rb->cols, rb->depth);
+    }
+
+    pthread_mutex_lock(&rb->lock);
+    if(rb->window)
+      rb->band_ready[band % rb->window_bands] = band + 1;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+  }
+}
+
+/* remap_simple() using n_threads worker threads. Returns FALSE without
+   doing anything if they cannot be started. */
+static int remap_simple_parallel(mainprog_info *mainprog_ptr, const nq_context *nq, unsigned int cols, unsigned int rows, unsigned int* remap,  uch **row_pointers, const short *ordered, int n_threads, int verbose)
+{
+  remap_bands rb;
+  pthread_t *threads;
+  uch *own_row = mainprog_ptr->indexed_data;
+  unsigned int band, row, last;
+  int i, started = 0;
+
+  memset(&rb, 0, sizeof(rb));
+  rb.rgba_data = mainprog_ptr->rgba_data;
+  rb.nq = nq;
+  rb.remap = remap;
+  rb.ordered = ordered;
+  rb.cols = cols;
+  rb.rows = rows;
+  rb.channels = mainprog_ptr->channels;
+  rb.depth = mainprog_ptr->sample_depth;
+  rb.row_pointers = row_pointers;
+  rb.band_rows = MAX(1, REMAP_BAND_PIXELS / cols);
+  rb.n_bands = (rows + rb.band_rows - 1) / rb.band_rows;
+
+  threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+  if(!row_pointers){
+    rb.window_bands = 4 * n_threads;
+    rb.window = (uch *)malloc((size_t)rb.window_bands * rb.band_rows * cols);
+    rb.band_ready = (unsigned int *)calloc(rb.window_bands, sizeof(unsigned int));
+  }
+  if(!threads || (!row_pointers && (!rb.window || !rb.band_ready))){
+    free(threads);
+    free(rb.window);
+    free(rb.band_ready);
+    return FALSE;
+  }
+
+  pthread_mutex_init(&rb.lock, NULL);
+  pthread_cond_init(&rb.changed, NULL);
+  for(i = 0; i < n_threads; i++){
+    if(pthread_create(&threads[i], NULL, remap_band_worker, &rb) == 0)
+      started++;
+  }
+
+  if(started && rb.window){
+    /* write the bands out in order as they are finished */
+    for(band = 0; band < rb.n_bands; band++){
+      pthread_mutex_lock(&rb.lock);
+      while(rb.band_ready[band % rb.window_bands] != band + 1)
+        pthread_cond_wait(&rb.changed, &rb.lock);
+      pthread_mutex_unlock(&rb.lock);
+
+      last = MIN((band + 1) * rb.band_rows, rows);
+      for(row = band * rb.band_rows; row < last; row++){
+        mainprog_ptr->indexed_data = rb.window +
+          ((size_t)(band % rb.window_bands) * rb.band_rows + row - band * rb.band_rows) * cols;
+        rwpng_write_image_row(mainprog_ptr);
+      }
+
+      pthread_mutex_lock(&rb.lock);
+      rb.written_bands = band + 1;
+      pthread_cond_broadcast(&rb.changed);
+      pthread_mutex_unlock(&rb.lock);
+    }
+    mainprog_ptr->indexed_data = own_row;
+  }
+
+  for(i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_cond_destroy(&rb.changed);
+  pthread_mutex_destroy(&rb.lock);
+  free(threads);
+  free(rb.window);
+  free(rb.band_ready);
+
+  if(started)
+    PNGNQ_MESSAGE("  Remap cache: %lu hits, %lu misses (%d threads)\n", rb.hits, rb.misses, started);
+  return started > 0;
+}
+#endif
+
+
+/* Packs a pixel for the exact palette. Fully transparent pixels all
+   count as one colour. */
+static inline unsigned int exact_key(const uch *p)
+{
+    return p[3] ? (p[0] | p[1]<<8 | p[2]<<16 | (unsigned int)p[3]<<24) : 0;
+}
+
+/* Returns the slot of colour key: either the one holding it or the empty
+   one where it belongs */
+static inline unsigned int exact_slot(const exact_palette *pal, unsigned int key)
+{
+    unsigned int h = (key * 0x9E3779B1u) >> (32-EXACT_HASH_BITS);
+
+    while (pal->slot[h] && pal->colour[pal->slot[h]-1] != key)
+        h = (h+1) & (EXACT_HASH_SIZE-1);
+    return h;
+}
+
+/* Adds the colours of n_pixels pixels to pal. Gives up and returns FALSE
+   as soon as there are more than max_colours of them. */
+static int add_exact_palette(exact_palette *pal, const uch *pixels, int channels, size_t n_pixels, unsigned int max_colours)
+{
+    size_t i;
+    unsigned int j, n, key, last = 0, h;
+    uch tile[PIXEL_TILE*4];
+    const uch *p;
+
+    if (max_colours > MAXNETSIZE)
+        max_colours = MAXNETSIZE;
+
+    for (i = 0; i < n_pixels; i += n) {
+        n = MIN(PIXEL_TILE, n_pixels - i);
+        p = pixels + i*channels;
+        if (channels != 4) {
+            expand_pixels(p, tile, n, channels);
+            p = tile;
+        }
+        for (j = 0; j < n; j++, p += 4) {
+            key = exact_key(p);
+            if ((i || j) && key == last)
+                continue;		/* runs of one colour are common */
+            last = key;
+            h = exact_slot(pal, key);
+            if (!pal->slot[h]) {
+                if (pal->n_colours == max_colours)
+                    return FALSE;
+                pal->colour[pal->n_colours++] = key;
+                pal->slot[h] = pal->n_colours;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/* Collects the colours of the image into pal, see add_exact_palette() */
+int find_exact_palette(exact_palette *pal, const uch *pixels, int channels, size_t n_pixels, unsigned int max_colours)
+{
+    memset(pal, 0, sizeof(*pal));
+    return add_exact_palette(pal, pixels, channels, n_pixels, max_colours) && pal->n_colours > 0;
+}
+
+static void remap_exact_row(const exact_palette *pal, const uch *inrow, int channels, uch *outrow, unsigned int cols, const unsigned int* remap)
+{
+    unsigned int i, j, n;
+    uch tile[PIXEL_TILE*4];
+    const uch *p;
+
+    for( i=0;i<cols;i+=n){
+        n = MIN(PIXEL_TILE, cols-i);
+        p = inrow + i*channels;
+        if (channels != 4) {
+            expand_pixels(p, tile, n, channels);
+            p = tile;
+        }
+        for (j = 0; j < n; j++)
+            outrow[i+j] = remap[pal->slot[exact_slot(pal, exact_key(p+j*4))]-1];
+    }
+}
+
+static void remap_exact(mainprog_info *mainprog_ptr, const exact_palette *pal, unsigned int cols, unsigned int rows, unsigned int* remap,  uch **row_pointers)
+{
+    uch *outrow = NULL; /* Output image pixels */
+
+    unsigned int row;
+    /* Do each image row */
+    for ( row = 0; (size_t)row < rows; ++row )
+    {
+        outrow = row_pointers ? row_pointers[row] :
+        mainprog_ptr->indexed_data;
+        remap_exact_row(pal, mainprog_ptr->rgba_data + (size_t)row*cols*mainprog_ptr->channels,
+                        mainprog_ptr->channels, outrow, cols, remap);
+        pack_row(outrow, cols, mainprog_ptr->sample_depth);
+
+        /* unless the whole image is kept, write row now */
+        if (!row_pointers)
+            rwpng_write_image_row(mainprog_ptr);
+    }
+}
+
+/* See quantize.h */
+int quantize_palette(const uch *train_data, const signed char *train_frac, size_t train_pixels,
+                     int channels, const exact_palette *exact,
+                     unsigned int max_colours, int sample_factor, double gamma,
+                     int precision, int search, int verbose, nq_context **nq_ptr,
+                     unsigned char map[MAXNETSIZE][4], unsigned int *remap,
+                     unsigned int *n_colours, unsigned int *num_trans)
+{
+    nq_context *nq = NULL;
+    int bot_idx, top_idx; /* for remapping of indices */
+    int newcolors = max_colours;
+    int x;
+
+    if (sample_factor<1)
+    {
+        sample_factor = 1 + train_pixels / (512*512);
+        if (sample_factor > 10) sample_factor = 10;
+
+        if (sample_factor > 1)
+        {
+            PNGNQ_MESSAGE("Sampling 1//%d of image\n", sample_factor);
+        }
+    }
+
+    /* An image that already fits in the palette is kept exactly as it is */
+    if (exact) {
+        PNGNQ_MESSAGE("  Image has only %d colours, no quantization needed\n", exact->n_colours);
+        newcolors = exact->n_colours;
+        for (x = 0; x < newcolors; ++x) {
+            map[x][0] = exact->colour[x];
+            map[x][1] = exact->colour[x] >> 8;
+            map[x][2] = exact->colour[x] >> 16;
+            map[x][3] = exact->colour[x] >> 24;
+        }
+    } else {
+        /* Start neuquant */
+        if ((nq = nq_create()) == NULL)
+            return 17;
+        nq_set_precision(nq,precision);
+        nq_set_search(nq,search);
+        nq_set_channels(nq,channels);
+        nq_set_fraction(nq,train_frac);
+        initnet(nq,(unsigned char*)train_data,train_pixels*channels,newcolors,gamma);
+        learn(nq,sample_factor,verbose);
+        inxbuild(nq);
+        getcolormap(nq,(unsigned char*)map);
+    }
+
+    /* Remap indexes so all tRNS chunks are together */
+    PNGNQ_MESSAGE("  Remapping colormap to eliminate opaque tRNS-chunk entries...\n");
+
+    for (top_idx = newcolors-1, bot_idx = x = 0;  x < newcolors;  ++x) {
+        if (map[x][3] == 255) /* maxval */
+            remap[x] = top_idx--;
+        else
+            remap[x] = bot_idx++;
+    }
+
+    PNGNQ_MESSAGE( "%d entr%s left\n", bot_idx,(bot_idx == 1)? "y" : "ies");
+
+    /* sanity check:  top and bottom indices should have just crossed paths */
+    if (bot_idx != top_idx + 1) {
+        PNGNQ_WARNING("  Internal logic error: remapped bot_idx = %d, top_idx = %d\n",bot_idx, top_idx);
+        nq_destroy(nq);
+        return 18;
+    }
+
+    *nq_ptr = nq;
+    *n_colours = newcolors;
+    *num_trans = bot_idx;
+    return 0;
+}
+
+/* See quantize.h */
+int quantize_remap(mainprog_info *mainprog_ptr, const nq_context *nq, const exact_palette *exact,
+                   unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4],
+                   unsigned int n_colours, unsigned int *remap, uch **row_pointers,
+                   int quantization_method, int n_threads, int verbose)
+{
+    short ordered[ORDERED_TILE][ORDERED_TILE*4];
+    short *floyd_err;	/* error rows of remap_floyd() */
+
+    if (exact)
+    {
+        remap_exact(mainprog_ptr,exact,cols,rows,remap,row_pointers);
+    }
+    else if (quantization_method == QUANT_FLOYD)
+    {
+#if HAVE_PTHREAD_H
+      if (n_threads < 2 ||
+          !remap_floyd_parallel(mainprog_ptr,nq,cols,rows,map,remap,row_pointers,n_threads))
+#endif
+      {
+        /* Two rows of diffused error */
+        if ((floyd_err = (short *)calloc(2 * cols * 4, sizeof(short))) == NULL)
+          return 17;
+        remap_floyd(mainprog_ptr,nq,cols,rows,map,remap,row_pointers,floyd_err);
+        free(floyd_err);
+      }
+    }
+    else
+    {
+      if (quantization_method == QUANT_ORDERED)
+        ordered_offsets(map,n_colours,&ordered[0][0]);
+#if HAVE_PTHREAD_H
+      if (n_threads < 2 ||
+          !remap_simple_parallel(mainprog_ptr,nq,cols,rows,remap,row_pointers,
+                                 quantization_method == QUANT_ORDERED ? &ordered[0][0] : NULL,
+                                 n_threads,verbose))
+#endif
+        remap_simple(mainprog_ptr,nq,cols,rows,map,remap,row_pointers,
+                     quantization_method == QUANT_ORDERED ? &ordered[0][0] : NULL, verbose);
+    }
+    return 0;
+}
+
+/* Sets the output indices of the entries whose indices are in
+   [first, first+n) to first + their position in order */
+static void renumber(unsigned int *perm, const unsigned int *order, unsigned int first, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        perm[order[i]] = first + i;
+}
+
+/* See quantize.h */
+void order_by_luminance(unsigned char map[MAXNETSIZE][4], unsigned int n_colours,
+                        unsigned int num_trans, unsigned int *remap)
+{
+    unsigned int luma[MAXNETSIZE], order[MAXNETSIZE], perm[MAXNETSIZE];
+    unsigned int i, j, x, first, n, key;
+
+    for (x = 0; x < n_colours; x++)
+        luma[remap[x]] = 299*map[x][0] + 587*map[x][1] + 114*map[x][2];
+
+    /* insertion sort of each group, keeping equal ones in their order */
+    for (first = 0; first < n_colours; first += n) {
+        n = first < num_trans ? num_trans : n_colours - first;
+        for (i = 0; i < n; i++) {
+            key = first + i;
+            for (j = i; j > 0 && luma[order[j-1]] > luma[key]; j--)
+                order[j] = order[j-1];
+            order[j] = key;
+        }
+        renumber(perm, order, first, n);
+    }
+    for (x = 0; x < n_colours; x++)
+        remap[x] = perm[remap[x]];
+}
+
+/* See quantize.h. Counts how often each pair of indices is next to each
+   other, across or down, then lays each group out as a path: starting
+   from its most common colour, it adds whichever colour left is most
+   often next to one of the ends of the path to that end. */
+int order_by_neighbours(uch **row_pointers, unsigned int cols, unsigned int rows,
+                        unsigned int n_colours, unsigned int num_trans, unsigned int *remap)
+{
+    unsigned long (*pairs)[MAXNETSIZE];
+    unsigned long count[MAXNETSIZE], best_count;
+    unsigned int path[2*MAXNETSIZE], perm[MAXNETSIZE];
+    uch used[MAXNETSIZE], lookup[MAXNETSIZE];
+    unsigned int row, col, i, x, first, n, head, tail, best, at_head;
+    const uch *p, *above;
+
+    if ((pairs = (unsigned long (*)[MAXNETSIZE])calloc(MAXNETSIZE, sizeof(*pairs))) == NULL)
+        return 17;
+    memset(count, 0, sizeof(count));
+    for (row = 0; row < rows; row++) {
+        p = row_pointers[row];
+        above = row ? row_pointers[row-1] : NULL;
+        for (col = 0; col < cols; col++) {
+            count[p[col]]++;
+            if (col)
+                pairs[p[col-1]][p[col]]++;
+            if (above)
+                pairs[above[col]][p[col]]++;
+        }
+    }
+    for (x = 0; x < n_colours; x++)
+        for (i = 0; i < x; i++)
+            pairs[x][i] = pairs[i][x] = pairs[x][i] + pairs[i][x];
+
+    memset(used, 0, sizeof(used));
+    for (first = 0; first < n_colours; first += n) {
+        n = first < num_trans ? num_trans : n_colours - first;
+
+        /* the path grows both ways from the middle of path[] */
+        best = first;
+        for (i = first; i < first + n; i++)
+            if (count[i] > count[best])
+                best = i;
+        head = tail = MAXNETSIZE;
+        path[head] = best;
+        used[best] = TRUE;
+        while (tail - head + 1 < n) {
+            best_count = 0;
+            best = first;
+            at_head = FALSE;
+            for (i = first; i < first + n; i++) {
+                if (used[i])
+                    continue;
+                if (best_count == 0 && used[best])
+                    best = i;
+                if (pairs[path[tail]][i] > best_count) {
+                    best_count = pairs[path[tail]][i];
+                    best = i;
+                    at_head = FALSE;
+                }
+                if (pairs[path[head]][i] > best_count) {
+                    best_count = pairs[path[head]][i];
+                    best = i;
+                    at_head = TRUE;
+                }
+            }
+            used[best] = TRUE;
+            if (at_head)
+                path[--head] = best;
+            else
+                path[++tail] = best;
+        }
+        renumber(perm, path + head, first, n);
+    }
+    free(pairs);
+
+    for (x = 0; x < n_colours; x++) {
+        lookup[x] = perm[x];
+        remap[x] = perm[remap[x]];
+    }
+    for (row = 0; row < rows; row++) {
+        uch *q = row_pointers[row];
+        for (col = 0; col < cols; col++)
+            q[col] = lookup[q[col]];
+    }
+    return 0;
+}
+
+/* Reservoir sampling (Li's algorithm L): keeps a uniform random sample of
+   size pixels of everything passed to reservoir_add(), skipping straight
+   to the next pixel to take instead of drawing a number for each one. */
+static double reservoir_random(pixel_reservoir *res)
+{
+    res->rng ^= res->rng << 13;
+    res->rng ^= res->rng >> 7;
+    res->rng ^= res->rng << 17;
+    return ((res->rng >> 11) + 0.5) / 9007199254740992.0;	/* (0,1) */
+}
+
+static void reservoir_skip(pixel_reservoir *res)
+{
+    double skip = floor(log(reservoir_random(res)) / log(1.0 - res->w));
+
+    res->next = skip < (double)(SIZE_MAX - res->next - 1) ? res->next + (size_t)skip + 1 : SIZE_MAX;
+    res->w *= exp(log(reservoir_random(res)) / res->size);
+}
+
+static int reservoir_init(pixel_reservoir *res, size_t size, int channels)
+{
+    memset(res, 0, sizeof(*res));
+    res->size = size;
+    res->channels = channels;
+    res->rng = 0x9E3779B97F4A7C15ULL;
+    res->pixels = (uch *)malloc(size * channels);
+    return res->pixels != NULL;
+}
+
+static void reservoir_add(pixel_reservoir *res, const uch *pixels, size_t n_pixels)
+{
+    size_t take, bpp = res->channels;
+
+    /* fill it first */
+    take = MIN(n_pixels, res->size - res->n_pixels);
+    memcpy(res->pixels + res->n_pixels*bpp, pixels, take*bpp);
+    res->n_pixels += take;
+    res->seen += take;
+    pixels += take*bpp;
+    n_pixels -= take;
+    if (take && res->n_pixels == res->size) {
+        res->w = exp(log(reservoir_random(res)) / res->size);
+        res->next = res->seen - 1;
+        reservoir_skip(res);
+    }
+
+    while (n_pixels > 0 && res->next < res->seen + n_pixels) {
+        take = res->next - res->seen;
+        memcpy(res->pixels + (size_t)(reservoir_random(res) * res->size)*bpp, pixels + take*bpp, bpp);
+        pixels += (take+1)*bpp;
+        n_pixels -= take+1;
+        res->seen += take+1;
+        reservoir_skip(res);
+    }
+    res->seen += n_pixels;
+}
+
+/* Second pass over a streamed image: decodes it again through in_info and
+   maps each row as it comes. Keeps two rows of input, the current one and
+   the one below it that Floyd-Steinberg diffuses into. */
+int remap_stream(mainprog_info *mainprog_ptr, mainprog_info *in_info, const nq_context *nq, const exact_palette *exact, unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4], unsigned int n_colours, unsigned int* remap, int quantization_method, int verbose)
+{
+    uch *inrows;
+    const uch *in, *below;
+    remap_state *st = NULL;
+    short *floyd_err = NULL;	/* two rows of diffused error */
+    short ordered[ORDERED_TILE][ORDERED_TILE*4];
+    unsigned int row;
+
+    inrows = (uch *)malloc(2 * cols * 4);
+    if (!exact && quantization_method == QUANT_FLOYD)
+        floyd_err = (short *)calloc(2 * cols * 4, sizeof(short));
+    else if (!exact)
+        st = (remap_state *)malloc(sizeof(remap_state));
+    if (!inrows || (!exact && !floyd_err && !st)) {
+        free(inrows);
+        free(floyd_err);
+        free(st);
+        return 24;
+    }
+    if (st) {
+        if (quantization_method == QUANT_ORDERED)
+            ordered_offsets(map, n_colours, &ordered[0][0]);
+        remap_state_init(st, quantization_method == QUANT_ORDERED ? &ordered[0][0] : NULL, in_info->channels);
+    }
+
+    in_info->rgba_data = inrows;
+    if (rwpng_read_image_row(in_info) != 0)
+        goto done;
+
+    for (row = 0; row < rows; row++) {
+        in = inrows + (row&1)*cols*4;
+        below = in;
+        if (row+1 < rows) {
+            in_info->rgba_data = inrows + ((row+1)&1)*cols*4;
+            if (rwpng_read_image_row(in_info) != 0)
+                goto done;
+            below = in_info->rgba_data;
+        }
+
+        if (exact)
+            remap_exact_row(exact, in, in_info->channels, mainprog_ptr->indexed_data, cols, remap);
+        else if (quantization_method == QUANT_FLOYD)
+            remap_floyd_row(in, NULL, below, in_info->channels, nq, cols, row, map, remap,
+                            floyd_err + (row&1)*cols*4,
+                            row+1 < rows ? floyd_err + ((row+1)&1)*cols*4 : floyd_err + (row&1)*cols*4,
+                            mainprog_ptr->indexed_data, NULL);
+        else
+            remap_simple_row(in, mainprog_ptr->indexed_data, cols, row, nq, remap, st);
+        pack_row(mainprog_ptr->indexed_data, cols, mainprog_ptr->sample_depth);
+
+        if (rwpng_write_image_row(mainprog_ptr) != 0)
+            break;
+    }
+
+    if (st)
+        PNGNQ_MESSAGE("  Remap cache: %lu hits, %lu misses\n", st->hits, st->misses);
+ done:
+    in_info->rgba_data = NULL;
+    free(inrows);
+    free(floyd_err);
+    free(st);
+    if (in_info->retval)
+        return in_info->retval;
+    return mainprog_ptr->retval;
+}
+
+/* First pass over a streamed image: samples its pixels for training and
+   collects its colours while they fit in the palette. Finishes reading. */
+int sample_stream(mainprog_info *mainprog_ptr, pixel_reservoir *sample, size_t sample_size, exact_palette *exact, int *use_exact, unsigned int max_colours)
+{
+    ulg row, cols = mainprog_ptr->width;
+    uch *inrow;
+
+    *use_exact = FALSE;
+    inrow = (uch *)malloc(mainprog_ptr->rowbytes);
+    if (!inrow || !reservoir_init(sample, MIN(sample_size, (size_t)cols*mainprog_ptr->height),
+                                  mainprog_ptr->channels)) {
+        free(inrow);
+        rwpng_read_image_finish(mainprog_ptr);
+        mainprog_ptr->retval = 24;   /* out of memory */
+        return mainprog_ptr->retval;
+    }
+
+    memset(exact, 0, sizeof(*exact));
+    *use_exact = TRUE;
+    mainprog_ptr->rgba_data = inrow;
+    for (row = 0; row < mainprog_ptr->height; row++) {
+        if (rwpng_read_image_row(mainprog_ptr) != 0)
+            break;
+        if (*use_exact)
+            *use_exact = add_exact_palette(exact, inrow, mainprog_ptr->channels, cols, max_colours);
+        reservoir_add(sample, inrow, cols);
+    }
+    mainprog_ptr->rgba_data = NULL;
+    free(inrow);
+
+    *use_exact = *use_exact && exact->n_colours > 0;
+    if (mainprog_ptr->retval)
+        return mainprog_ptr->retval;
+    return rwpng_read_image_finish(mainprog_ptr);
+}
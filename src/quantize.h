@@ -0,0 +1,130 @@
+/* quantize.h - the quantizer shared by pngnq and libpngnq: chooses the
+** palette of an image and maps its pixels to it.
+**
+** Include png.h, neuquant32.h and rwpng.h first.
+**
+** Copyright (C) 2004-2009 by Stuart Coyle
+** Copyright (C) Kornel Lesiński (2009)
+**
+** Permission to use, copy, modify, and distribute this software and its
+** documentation for any purpose and without fee is hereby granted, provided
+** that the above copyright notice appear in all copies and that both that
+** copyright notice and this permission notice appear in supporting
+** documentation.  This software is provided "as is" without express or
+** implied warranty.
+*/
+
+#if HAVE_PTHREAD_H
+/* Where messages about the file a thread is working on go. Workers in
+   parallel mode collect them in memory so they come out in input order. */
+extern __thread FILE *thread_msgout;
+#  define PNGNQ_MSGOUT (thread_msgout ? thread_msgout : stderr)
+#endif
+
+/* Quantization (-Q) methods */
+#define QUANT_NONE 0
+#define QUANT_FLOYD 1
+#define QUANT_ORDERED 2
+
+/* Palette orders (-P), within the entries that are not opaque and within
+   the opaque ones */
+#define ORDER_NONE 0		/* as the network left them */
+#define ORDER_LUMINANCE 1
+#define ORDER_NEIGHBOURS 2	/* colours often next to each other get nearby indices */
+
+/* Uniform random sample of the pixels of a streamed image */
+typedef struct {
+  uch *pixels;			/* size pixels, as read */
+  size_t size;
+  int channels;			/* bytes per pixel */
+  size_t n_pixels;		/* pixels in the sample so far */
+  size_t seen;			/* pixels offered so far */
+  size_t next;			/* number of the next pixel to take, once full */
+  double w;
+  unsigned long long rng;	/* xorshift state */
+} pixel_reservoir;
+
+/* Colours of an image that has no more of them than the palette, kept in a
+   small open addressing hash table keyed on the packed RGBA value */
+#define EXACT_HASH_BITS 10		/* 4*MAXNETSIZE slots */
+#define EXACT_HASH_SIZE (1<<EXACT_HASH_BITS)
+
+typedef struct {
+  unsigned int n_colours;
+  unsigned int colour[MAXNETSIZE];	/* packed RGBA, red in the low byte */
+  unsigned short slot[EXACT_HASH_SIZE];	/* index into colour[] + 1, 0 if empty */
+} exact_palette;
+
+/* Input pixels have 1 to 4 channels: gray, gray+alpha, RGB or RGBA, as
+   rwpng reads them with native set. Palettes are always RGBA. */
+
+/* Collects the colours of n_pixels pixels into pal. Returns FALSE if
+   there are none or more than max_colours of them. */
+int find_exact_palette(exact_palette *pal, const uch *pixels, int channels, size_t n_pixels,
+                       unsigned int max_colours);
+
+/* Chooses the palette of an image: the colours in exact if it is not NULL,
+   otherwise what a network learns from train_pixels pixels, and from
+   train_frac, the rwpng frac_data of them, if not NULL. Fills
+   map, and remap with the output index of each entry such that the entries
+   that are not opaque come first. The network is left in *nq_ptr for
+   mapping pixels, NULL for an exact palette; nq_destroy() it when done.
+   Returns 0 or an error code. */
+int quantize_palette(const uch *train_data, const signed char *train_frac, size_t train_pixels,
+                     int channels, const exact_palette *exact,
+                     unsigned int max_colours, int sample_factor, double gamma,
+                     int precision, int search, int verbose, nq_context **nq_ptr,
+                     unsigned char map[MAXNETSIZE][4], unsigned int *remap,
+                     unsigned int *n_colours, unsigned int *num_trans);
+
+/* Maps the pixels of mainprog_ptr->rgba_data, of mainprog_ptr->channels
+   each, to the palette into row_pointers, or if that is NULL, one row at
+   a time into indexed_data and out through rwpng_write_image_row(). Rows
+   are packed to mainprog_ptr->sample_depth bits per pixel. nq is NULL for
+   an exact palette. n_threads above 1 spreads the work over that many
+   threads. Returns 0 or an error code. */
+int quantize_remap(mainprog_info *mainprog_ptr, const nq_context *nq, const exact_palette *exact,
+                   unsigned int cols, unsigned int rows, unsigned char map[MAXNETSIZE][4],
+                   unsigned int n_colours, unsigned int *remap, uch **row_pointers,
+                   int quantization_method, int n_threads, int verbose);
+
+/* Returns the bit depth that holds indices below n_colours: 1, 2, 4 or 8 */
+int palette_depth(unsigned int n_colours);
+
+/* Whether the palette can be written as a grayscale image instead: its
+   opaque colours are grays that, with a level to spare for the fully
+   transparent ones if any, fit in no more bits than indices into it, and
+   it has no colours partly transparent. If so, sets remap to the gray
+   level of each entry, *num_trans to 1 if the spare level is transparent
+   and *trans_gray to it, and returns the bit depth. Otherwise returns 0. */
+int gray_remap(unsigned char map[MAXNETSIZE][4], unsigned int n_colours, unsigned int *remap,
+               unsigned int *num_trans, uch *trans_gray);
+
+/* Packs rows of one index per byte to depth bits per index, in place, as
+   quantize_remap() does by itself for mainprog_ptr->sample_depth below 8 */
+void pack_rows(uch **row_pointers, unsigned int cols, unsigned int rows, int depth);
+
+/* Renumbers the output indices of remap by luminance */
+void order_by_luminance(unsigned char map[MAXNETSIZE][4], unsigned int n_colours,
+                        unsigned int num_trans, unsigned int *remap);
+
+/* Renumbers the output indices of remap and of the mapped image in
+   row_pointers so that colours that are often next to each other get
+   nearby indices, which row filters can make more of. Returns 0 or an
+   error code. */
+int order_by_neighbours(uch **row_pointers, unsigned int cols, unsigned int rows,
+                        unsigned int n_colours, unsigned int num_trans, unsigned int *remap);
+
+/* First pass over a streamed image: samples its pixels for training and
+   collects its colours while they fit in the palette. Finishes reading.
+   Returns 0 or an error code, which is also left in mainprog_ptr->retval. */
+int sample_stream(mainprog_info *mainprog_ptr, pixel_reservoir *sample, size_t sample_size,
+                  exact_palette *exact, int *use_exact, unsigned int max_colours);
+
+/* Second pass over a streamed image: decodes it again through in_info and
+   writes each row as it is mapped, as quantize_remap() does without
+   row_pointers. */
+int remap_stream(mainprog_info *mainprog_ptr, mainprog_info *in_info, const nq_context *nq,
+                 const exact_palette *exact, unsigned int cols, unsigned int rows,
+                 unsigned char map[MAXNETSIZE][4], unsigned int n_colours, unsigned int *remap,
+                 int quantization_method, int verbose);
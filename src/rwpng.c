@@ -29,8 +29,18 @@
 
   ---------------------------------------------------------------------------*/
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if HAVE_SYS_MMAN_H && HAVE_MMAP
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  define RWPNG_MMAP
+#endif
 
 #include "png.h"        /* libpng header; includes zlib.h */
 #include "rwpng.h"      /* typedefs, common macros, public prototypes */
@@ -42,6 +52,12 @@
 #endif
 
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg);
+static void rwpng_release_input(mainprog_info *mainprog_ptr);
+static int rwpng_read_image_start(FILE *infile, mainprog_info *mainprog_ptr);
+static int rwpng_write_image_start(FILE *outfile, mainprog_info *mainprog_ptr);
+
+/* largest image, in pixels, that RWPNG_ZLIB_AUTO compresses at the best level */
+#define RWPNG_AUTO_SMALL (1<<20)
 
 
 void rwpng_version_info(void)
@@ -54,6 +70,65 @@ void rwpng_version_info(void)
 
 
 
+/* libpng read callback for input from memory or a mapped file */
+
+static void rwpng_read_buf(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    mainprog_info *mainprog_ptr = (mainprog_info *)png_get_io_ptr(png_ptr);
+
+    if (length > mainprog_ptr->in_buf_size - mainprog_ptr->in_buf_pos)
+        png_error(png_ptr, "unexpected end of file");
+    memcpy(data, mainprog_ptr->in_buf + mainprog_ptr->in_buf_pos, length);
+    mainprog_ptr->in_buf_pos += length;
+}
+
+
+/* maps infile from its current position on, if it is a regular file;
+ * leaves in_buf NULL otherwise */
+
+static void rwpng_map_input(FILE *infile, mainprog_info *mainprog_ptr)
+{
+#ifdef RWPNG_MMAP
+    struct stat st;
+    long pos = ftell(infile);
+    void *map;
+
+    mainprog_ptr->in_buf = NULL;
+    mainprog_ptr->in_mapped = 0;
+    if (pos < 0 || fstat(fileno(infile), &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size <= pos || (off_t)(size_t)st.st_size != st.st_size)
+        return;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(infile), 0);
+    if (map == MAP_FAILED)
+        return;
+#if HAVE_MADVISE
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+    mainprog_ptr->in_buf = (const uch *)map;
+    mainprog_ptr->in_buf_size = st.st_size;
+    mainprog_ptr->in_buf_pos = pos;
+    mainprog_ptr->in_mapped = 1;
+#else
+    mainprog_ptr->in_buf = NULL;
+    mainprog_ptr->in_mapped = 0;
+#endif
+}
+
+
+/* done with in_buf: unmaps it if it is a mapping of the input file */
+
+static void rwpng_release_input(mainprog_info *mainprog_ptr)
+{
+#ifdef RWPNG_MMAP
+    if (mainprog_ptr->in_mapped)
+        munmap((void *)mainprog_ptr->in_buf, mainprog_ptr->in_buf_size);
+#endif
+    mainprog_ptr->in_buf = NULL;
+    mainprog_ptr->in_mapped = 0;
+}
+
+
 /*
    retval:
      0 = success
@@ -65,22 +140,73 @@ void rwpng_version_info(void)
  */
 
 int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
+{
+    if (rwpng_read_image_init(infile, mainprog_ptr) != 0)
+        return mainprog_ptr->retval;
+    return rwpng_read_image_whole(mainprog_ptr);
+}
+
+
+/* same as rwpng_read_image(), for a PNG file of size bytes at buf */
+
+int rwpng_read_image_mem(const void *buf, size_t size, mainprog_info *mainprog_ptr)
+{
+    if (rwpng_read_image_init_mem(buf, size, mainprog_ptr) != 0)
+        return mainprog_ptr->retval;
+    return rwpng_read_image_whole(mainprog_ptr);
+}
+
+
+/* reads everything up to the image data and sets up the transformations
+ * to RGBA; the rows are read next, by rwpng_read_image_whole() or by one
+ * rwpng_read_image_row() call each and rwpng_read_image_finish() */
+
+int rwpng_read_image_init(FILE *infile, mainprog_info *mainprog_ptr)
+{
+    /* a regular file is read straight from a mapping of it rather than
+     * through stdio; anything else, or if mapping fails, uses infile */
+
+    rwpng_map_input(infile, mainprog_ptr);
+    return rwpng_read_image_start(infile, mainprog_ptr);
+}
+
+
+/* same as rwpng_read_image_init(), for a PNG file of size bytes at buf,
+ * which must stay there until the image is read */
+
+int rwpng_read_image_init_mem(const void *buf, size_t size, mainprog_info *mainprog_ptr)
+{
+    mainprog_ptr->in_buf = (const uch *)buf;
+    mainprog_ptr->in_buf_size = size;
+    mainprog_ptr->in_buf_pos = 0;
+    mainprog_ptr->in_mapped = 0;
+    return rwpng_read_image_start(NULL, mainprog_ptr);
+}
+
+
+/* reads from in_buf if it is set, otherwise from infile */
+
+static int rwpng_read_image_start(FILE *infile, mainprog_info *mainprog_ptr)
 {
     png_structp  png_ptr = NULL;
     png_infop    info_ptr = NULL;
-    png_uint_32  i, rowbytes;
     int          color_type, bit_depth;
     uch          sig[8];
     png_color_16p  background;
-    int num_comments;
-    int c;
-    png_text *comments;
 
     /* first do a quick check that the file really is a PNG image; could
      * have used slightly more general png_sig_cmp() function instead */
 
-    fread(sig, 1, 8, infile);
+    if (mainprog_ptr->in_buf) {
+        if (mainprog_ptr->in_buf_size - mainprog_ptr->in_buf_pos < 8)
+            memset(sig, 0, 8);
+        else
+            memcpy(sig, mainprog_ptr->in_buf + mainprog_ptr->in_buf_pos, 8);
+        mainprog_ptr->in_buf_pos += 8;
+    } else
+        fread(sig, 1, 8, infile);
     if (!png_check_sig(sig, 8)) {
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 21;   /* bad signature */
         return mainprog_ptr->retval;
     }
@@ -89,6 +215,7 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
     png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
       rwpng_error_handler, NULL);
     if (!png_ptr) {
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 24;   /* out of memory */
         return mainprog_ptr->retval;
     }
@@ -97,6 +224,7 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
     info_ptr = png_create_info_struct(png_ptr);
     if (!info_ptr) {
         png_destroy_read_struct(&png_ptr, NULL, NULL);
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 24;   /* out of memory */
         return mainprog_ptr->retval;
     }
@@ -114,12 +242,16 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
 
     if (setjmp(mainprog_ptr->jmpbuf)) {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 25;   /* fatal libpng error (via longjmp()) */
         return mainprog_ptr->retval;
     }
 
 
-    png_init_io(png_ptr, infile);
+    if (mainprog_ptr->in_buf)
+        png_set_read_fn(png_ptr, mainprog_ptr, rwpng_read_buf);
+    else
+        png_init_io(png_ptr, infile);
     png_set_sig_bytes(png_ptr, 8);  /* we already read the 8 signature bytes */
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
@@ -134,22 +266,25 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
     
     /* expand palette images to RGB, low-bit-depth grayscale images to 8 bits,
      * transparency chunks to full alpha channel; strip 16-bit-per-sample
-     * images to 8 bits per sample; and convert grayscale to RGB[A] */
+     * images to 8 bits per sample unless keep_16; and convert grayscale
+     * to RGB[A] */
+
+    /* with native set, gray, gray+alpha and RGB stay as they are, so the
+     * image takes a quarter to three quarters of the memory */
 
-    /* GRR TO DO:  handle each of GA, RGB, RGBA without conversion to RGBA */
-    /* GRR TO DO:  allow sub-8-bit quantization? */
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
     /* GRR TO DO:  get and map background color? */
 
-    if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_expand(png_ptr);
+    if (!(color_type & PNG_COLOR_MASK_ALPHA) && !mainprog_ptr->native) {
 #ifdef PNG_READ_FILLER_SUPPORTED
-        /* GRP:  expand palette to RGB, and grayscale or RGB to GA or RGBA */
-        if (color_type == PNG_COLOR_TYPE_PALETTE)
-            png_set_expand(png_ptr);
+        /* GRP:  expand grayscale or RGB to GA or RGBA */
         png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
 #else
         fprintf(stderr, "pngnq readpng:  image is neither RGBA nor GA\n");
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 26;
         return mainprog_ptr->retval;
 #endif
@@ -160,12 +295,14 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
     if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
         png_set_expand(png_ptr);
  
-    /* GRR TO DO:  handle 16-bps data natively? */
-    if (bit_depth == 16)
+    /* with keep_16, 16-bps data is read whole and rounded to 8 bits
+     * afterwards, see rwpng_split_16() */
+    if (bit_depth != 16)
+        mainprog_ptr->keep_16 = FALSE;
+    if (bit_depth == 16 && !mainprog_ptr->keep_16)
         png_set_strip_16(png_ptr);
-    /* GRR TO DO:  probably want to handle this separately, without expansion */
-    if (color_type == PNG_COLOR_TYPE_GRAY ||
-        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    if (!mainprog_ptr->native && (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA))
         png_set_gray_to_rgb(png_ptr);
 
 
@@ -211,18 +348,74 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
 
     png_read_update_info(png_ptr, info_ptr);
 
-    mainprog_ptr->rowbytes = rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    mainprog_ptr->rowbytes = png_get_rowbytes(png_ptr, info_ptr);
     mainprog_ptr->channels = (int)png_get_channels(png_ptr, info_ptr);
 
-    if ((mainprog_ptr->rgba_data = (uch *)malloc(rowbytes*mainprog_ptr->height)) == NULL) {
+    mainprog_ptr->retval = 0;
+    return 0;
+}
+
+
+/* rounds the n 16-bit samples at in, most significant byte first, to 8
+ * bits into data, and keeps what each is off by in 256ths of a level in
+ * frac; 65535 is 255.  in is data + n, so both go forwards without
+ * overwriting samples still to be read */
+
+static void rwpng_split_16(const uch *in, uch *data, signed char *frac, size_t n)
+{
+    size_t i;
+    unsigned int v, t, r;
+
+    for (i = 0;  i < n;  ++i) {
+        v = (unsigned int)in[i*2] << 8 | in[i*2+1];
+        t = (v*256 + 128) / 257;    /* the sample in 256ths of a level */
+        r = (t + 128) >> 8;
+        data[i] = (uch)r;
+        frac[i] = (signed char)((int)t - (int)(r << 8));
+    }
+}
+
+
+/* allocates rgba_data and row_pointers and reads the whole image; with
+ * keep_16 set for a 16-bit image, rgba_data also holds frac_data after
+ * the samples, and rowbytes becomes that of the 8-bit rows */
+
+int rwpng_read_image_whole(mainprog_info *mainprog_ptr)
+{
+    png_structp  png_ptr = (png_structp)mainprog_ptr->png_ptr;
+    png_infop    info_ptr = (png_infop)mainprog_ptr->info_ptr;
+    png_uint_32  i, rowbytes = mainprog_ptr->rowbytes;
+    size_t       n = 0;     /* samples, if 16-bit */
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
+        mainprog_ptr->png_ptr = NULL;
+        mainprog_ptr->info_ptr = NULL;
+        free(mainprog_ptr->rgba_data);
+        free(mainprog_ptr->row_pointers);
+        mainprog_ptr->rgba_data = NULL;
+        mainprog_ptr->row_pointers = NULL;
+        mainprog_ptr->retval = 25;   /* fatal libpng error (via longjmp()) */
+        return mainprog_ptr->retval;
+    }
+
+    /* 16-bit rows are read after room for the 8-bit samples */
+    mainprog_ptr->frac_data = NULL;
+    if (mainprog_ptr->keep_16)
+        n = (size_t)(rowbytes/2)*mainprog_ptr->height;
+
+    if ((mainprog_ptr->rgba_data = (uch *)malloc((size_t)rowbytes*mainprog_ptr->height + n)) == NULL) {
         fprintf(stderr, "pngquant readpng:  unable to allocate image data\n");
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
         mainprog_ptr->retval = 24;
         return mainprog_ptr->retval;
     }
     if ((mainprog_ptr->row_pointers = (png_bytepp)malloc(mainprog_ptr->height*sizeof(png_bytep))) == NULL) {
         fprintf(stderr, "pngquant readpng:  unable to allocate row pointers\n");
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
         free(mainprog_ptr->rgba_data);
         mainprog_ptr->rgba_data = NULL;
         mainprog_ptr->retval = 24;
@@ -235,13 +428,72 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
     /* set the individual row_pointers to point at the correct offsets */
 
     for (i = 0;  i < mainprog_ptr->height;  ++i)
-        mainprog_ptr->row_pointers[i] = mainprog_ptr->rgba_data + i*rowbytes;
+        mainprog_ptr->row_pointers[i] = mainprog_ptr->rgba_data + n + (size_t)i*rowbytes;
 
 
     /* now we can go ahead and just read the whole image */
 
     png_read_image(png_ptr, (png_bytepp)mainprog_ptr->row_pointers);
 
+    if (n) {
+        uch *data = mainprog_ptr->rgba_data;
+
+        rwpng_split_16(data + n, data, (signed char *)data + n, n);
+        if ((data = (uch *)realloc(data, 2*n)) != NULL)
+            mainprog_ptr->rgba_data = data;
+        mainprog_ptr->frac_data = (signed char *)mainprog_ptr->rgba_data + n;
+        mainprog_ptr->rowbytes = rowbytes /= 2;
+        for (i = 0;  i < mainprog_ptr->height;  ++i)
+            mainprog_ptr->row_pointers[i] = mainprog_ptr->rgba_data + (size_t)i*rowbytes;
+    }
+
+    return rwpng_read_image_finish(mainprog_ptr);
+}
+
+
+/* this routine is called only for non-interlaced images */
+/* reads the next row into rgba_data, which points at one row of rowbytes */
+/* returns 0 if succeeds, 25 if libpng problem */
+
+int rwpng_read_image_row(mainprog_info *mainprog_ptr)
+{
+    png_structp  png_ptr = (png_structp)mainprog_ptr->png_ptr;
+    png_infop    info_ptr = (png_infop)mainprog_ptr->info_ptr;
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
+        mainprog_ptr->png_ptr = NULL;
+        mainprog_ptr->info_ptr = NULL;
+        mainprog_ptr->retval = 25;   /* fatal libpng error (via longjmp()) */
+        return mainprog_ptr->retval;
+    }
+
+    png_read_row(png_ptr, mainprog_ptr->rgba_data, NULL);
+
+    mainprog_ptr->retval = 0;
+    return 0;
+}
+
+
+/* reads what follows the image data and frees the libpng structs */
+
+int rwpng_read_image_finish(mainprog_info *mainprog_ptr)
+{
+    png_structp  png_ptr = (png_structp)mainprog_ptr->png_ptr;
+    png_infop    info_ptr = (png_infop)mainprog_ptr->info_ptr;
+    int num_comments;
+    int c;
+    png_text *comments;
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        rwpng_release_input(mainprog_ptr);
+        mainprog_ptr->png_ptr = NULL;
+        mainprog_ptr->info_ptr = NULL;
+        mainprog_ptr->retval = 25;   /* fatal libpng error (via longjmp()) */
+        return mainprog_ptr->retval;
+    }
 
     /* and we're done!  (png_read_end() can be omitted if no processing of
      * post-IDAT text/time/etc. is desired) */
@@ -263,6 +515,7 @@ int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr)
       };
 
 png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+rwpng_release_input(mainprog_ptr);
 mainprog_ptr->png_ptr = NULL;
 mainprog_ptr->info_ptr = NULL;
 
@@ -280,6 +533,65 @@ mainprog_ptr->info_ptr = NULL;
  */
 
 int rwpng_write_image_init(FILE *outfile, mainprog_info *mainprog_ptr)
+{
+    return rwpng_write_image_start(outfile, mainprog_ptr);
+}
+
+
+/* libpng write callbacks for output to memory */
+
+static void rwpng_write_buf(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    mainprog_info *mainprog_ptr = (mainprog_info *)png_get_io_ptr(png_ptr);
+    size_t alloc;
+    uch *buf;
+
+    if (length > mainprog_ptr->out_alloc - mainprog_ptr->out_size) {
+        alloc = mainprog_ptr->out_alloc ? mainprog_ptr->out_alloc : 8192;
+        while (length > alloc - mainprog_ptr->out_size)
+            alloc *= 2;
+        if ((buf = (uch *)realloc(mainprog_ptr->out_buf, alloc)) == NULL)
+            png_error(png_ptr, "out of memory for output");
+        mainprog_ptr->out_buf = buf;
+        mainprog_ptr->out_alloc = alloc;
+    }
+    memcpy(mainprog_ptr->out_buf + mainprog_ptr->out_size, data, length);
+    mainprog_ptr->out_size += length;
+}
+
+static void rwpng_flush_buf(png_structp png_ptr)
+{
+}
+
+
+/* same as rwpng_write_image_init(), but the PNG file goes to out_buf, of
+ * out_size bytes, which grows as needed; the caller free()s it */
+
+int rwpng_write_image_init_mem(mainprog_info *mainprog_ptr)
+{
+    mainprog_ptr->out_buf = NULL;
+    mainprog_ptr->out_size = 0;
+    mainprog_ptr->out_alloc = 0;
+    return rwpng_write_image_start(NULL, mainprog_ptr);
+}
+
+
+/* Level for RWPNG_ZLIB_AUTO: the best for small images, where it costs
+ * little. On larger ones level 9 can take twice as long as zlib's default
+ * of 6, which gives output only some 5-15% larger; lower levels than that
+ * save little more time and give up much more size. */
+
+static int rwpng_auto_level(mainprog_info *mainprog_ptr)
+{
+    size_t pixels = (size_t)mainprog_ptr->width * mainprog_ptr->height;
+
+    return pixels <= RWPNG_AUTO_SMALL ? Z_BEST_COMPRESSION : 6;
+}
+
+
+/* writes to outfile, or to out_buf if outfile is NULL */
+
+static int rwpng_write_image_start(FILE *outfile, mainprog_info *mainprog_ptr)
 {
     png_structp png_ptr;       /* note:  temporary variables! */
     png_infop info_ptr;
@@ -317,23 +629,29 @@ int rwpng_write_image_init(FILE *outfile, mainprog_info *mainprog_ptr)
 
     /* make sure outfile is (re)opened in BINARY mode */
 
-    png_init_io(png_ptr, outfile);
+    if (outfile)
+        png_init_io(png_ptr, outfile);
+    else
+        png_set_write_fn(png_ptr, mainprog_ptr, rwpng_write_buf, rwpng_flush_buf);
 
 
     /* set the compression levels--in general, always want to leave filtering
      * turned on (except for palette images) and allow all of the filters,
-     * which is the default; want 32K zlib window, unless entire image buffer
-     * is 16K or smaller (unknown here)--also the default; usually want max
-     * compression (NOT the default); and remaining compression flags should
-     * be left alone */
-
-    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+     * which is the default; the level, strategy and window come from the
+     * caller, who usually wants max compression (NOT the default); and
+     * remaining compression flags should be left alone */
+
+    if (mainprog_ptr->zlib.level == RWPNG_ZLIB_AUTO)
+        mainprog_ptr->zlib.level = rwpng_auto_level(mainprog_ptr);
+    png_set_compression_level(png_ptr, mainprog_ptr->zlib.level);
+    png_set_compression_strategy(png_ptr, mainprog_ptr->zlib.strategy);
+    if (mainprog_ptr->zlib.window_bits)
+        png_set_compression_window_bits(png_ptr, mainprog_ptr->zlib.window_bits);
+    if (mainprog_ptr->zlib.filters)
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, mainprog_ptr->zlib.filters);
 /*
-    >> this is default for no filtering; Z_FILTERED is default otherwise:
-    png_set_compression_strategy(png_ptr, Z_DEFAULT_STRATEGY);
     >> these are all defaults:
     png_set_compression_mem_level(png_ptr, 8);
-    png_set_compression_window_bits(png_ptr, 15);
     png_set_compression_method(png_ptr, 8);
  */
 
@@ -341,24 +659,49 @@ int rwpng_write_image_init(FILE *outfile, mainprog_info *mainprog_ptr)
     /* set the image parameters appropriately */
 
     png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
-      mainprog_ptr->sample_depth, PNG_COLOR_TYPE_PALETTE,
+      mainprog_ptr->sample_depth,
+      mainprog_ptr->gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_PALETTE,
       mainprog_ptr->interlaced, PNG_COMPRESSION_TYPE_DEFAULT,
       PNG_FILTER_TYPE_DEFAULT);
 
-    /* GRR WARNING:  cast of rwpng_colorp to png_colorp could fail in future
-     * major revisions of libpng (but png_ptr/info_ptr will fail, regardless) */
-    png_set_PLTE(png_ptr, info_ptr, (png_colorp)mainprog_ptr->palette,
-      mainprog_ptr->num_palette);
+    if (mainprog_ptr->gray) {
+        /* no palette; at most one gray level is transparent */
+        if (mainprog_ptr->num_trans > 0) {
+            png_color_16  trans_color;
 
-    if (mainprog_ptr->num_trans > 0)
-        png_set_tRNS(png_ptr, info_ptr, mainprog_ptr->trans,
-          mainprog_ptr->num_trans, NULL);
+            memset(&trans_color, 0, sizeof(trans_color));
+            trans_color.gray = mainprog_ptr->trans_gray;
+            png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trans_color);
+        }
+    } else {
+        /* GRR WARNING:  cast of rwpng_colorp to png_colorp could fail in future
+         * major revisions of libpng (but png_ptr/info_ptr will fail, regardless) */
+        png_set_PLTE(png_ptr, info_ptr, (png_colorp)mainprog_ptr->palette,
+          mainprog_ptr->num_palette);
+
+        if (mainprog_ptr->num_trans > 0)
+            png_set_tRNS(png_ptr, info_ptr, mainprog_ptr->trans,
+              mainprog_ptr->num_trans, NULL);
+    }
 
     if (mainprog_ptr->gamma > 0.0)
         png_set_gAMA(png_ptr, info_ptr, mainprog_ptr->gamma);
 
 
-    if (mainprog_ptr->have_bg) {   /* we know it's RGBA, not gray+alpha */
+    if (mainprog_ptr->have_bg && mainprog_ptr->gray) {
+        /* only a gray the image's depth can hold */
+        int step = 255 / ((1 << mainprog_ptr->sample_depth) - 1);
+
+        if (mainprog_ptr->bg_red == mainprog_ptr->bg_green &&
+            mainprog_ptr->bg_green == mainprog_ptr->bg_blue &&
+            mainprog_ptr->bg_red % step == 0) {
+            png_color_16  background;
+
+            memset(&background, 0, sizeof(background));
+            background.gray = mainprog_ptr->bg_red / step;
+            png_set_bKGD(png_ptr, info_ptr, &background);
+        }
+    } else if (mainprog_ptr->have_bg) {   /* we know it's RGBA, not gray+alpha */
         png_color_16  background;
 
         background.red = mainprog_ptr->bg_red;
@@ -430,10 +773,9 @@ int rwpng_write_image_init(FILE *outfile, mainprog_info *mainprog_ptr)
      * allowed) */
 
 
-    /* set up the transformations:  for now, just pack low-bit-depth pixels
-     * into bytes (one, two or four pixels per byte) */
+    /* no transformations:  low-bit-depth rows are packed (two, four or
+     * eight pixels per byte) as they are mapped, see pack_row() */
 
-    png_set_packing(png_ptr);
 /*  png_set_shift(png_ptr, &sig_bit);  to scale low-bit-depth values */
 
 
@@ -63,6 +63,17 @@ typedef struct _rwpng_color_struct {
    png_byte blue;
 } rwpng_color;
 
+/* How the image data of a PNG file being written is compressed */
+#define RWPNG_ZLIB_AUTO -2	/* level: by image size, best for small ones
+				   (-1 is zlib's Z_DEFAULT_COMPRESSION) */
+
+typedef struct {
+    int level;			/* 0-9, or RWPNG_ZLIB_AUTO */
+    int strategy;		/* Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, ... */
+    int window_bits;		/* 8-15, 0 for libpng's choice */
+    int filters;		/* PNG_FILTER_* row filters to choose from, 0 for libpng's choice */
+} rwpng_zlib;
+
 typedef struct _mainprog_info {
     uch have_gamma;     /* read */
     double gamma;       /* read/write */
@@ -87,14 +98,31 @@ typedef struct _mainprog_info {
     rwpng_color palette[256];	/* write */
     uch trans[256];		/* write */
     uch *rgba_data;		/* read */
+    signed char *frac_data;	/* read: with keep_16, what each sample of rgba_data is
+				   off by, in 256ths of a level; NULL if not 16 bit */
+    const uch *in_buf;		/* read: the input file, in memory or mapped */
+    size_t in_buf_size;
+    size_t in_buf_pos;		/* read position in in_buf */
+    int in_mapped;		/* read: in_buf is a mapping of the file */
+    uch *out_buf;		/* write: the output file, if written to memory */
+    size_t out_size;		/* write: bytes in out_buf */
+    size_t out_alloc;		/* write: bytes allocated for out_buf */
     uch *indexed_data;		/* write */
     uch **row_pointers;		/* read/write */
     jmp_buf jmpbuf;		/* read/write */
     int interlaced;		/* read/write */
-    int channels;		/* read (currently not used) */
-    int sample_depth;		/* write */
+    int channels;		/* read: bytes per pixel of rgba_data */
+    int native;			/* read: keep gray, gray+alpha and RGB pixels as they
+				   are, instead of expanding them to RGBA */
+    int keep_16;		/* read: round 16 bit samples to 8 and keep the rest
+				   in frac_data, instead of dropping the low byte;
+				   for rwpng_read_image_whole() only */
+    int sample_depth;		/* write: 1, 2, 4 or 8; rows come packed to it */
+    rwpng_zlib zlib;		/* write: set it; auto is replaced by the level used */
     int num_palette;		/* write */
     int num_trans;		/* write */
+    int gray;			/* write: pixels are gray levels, not palette indices */
+    uch trans_gray;		/* write: the gray level that is transparent, if num_trans */
     int retval;			/* read/write */
     int have_bg;
     uch bg_red;
@@ -118,8 +146,22 @@ void rwpng_version_info(void);
 
 int rwpng_read_image(FILE *infile, mainprog_info *mainprog_ptr);
 
+int rwpng_read_image_init(FILE *infile, mainprog_info *mainprog_ptr);
+
+int rwpng_read_image_mem(const void *buf, size_t size, mainprog_info *mainprog_ptr);
+
+int rwpng_read_image_init_mem(const void *buf, size_t size, mainprog_info *mainprog_ptr);
+
+int rwpng_read_image_whole(mainprog_info *mainprog_ptr);
+
+int rwpng_read_image_row(mainprog_info *mainprog_ptr);
+
+int rwpng_read_image_finish(mainprog_info *mainprog_ptr);
+
 int rwpng_write_image_init(FILE *outfile, mainprog_info *mainprog_ptr);
 
+int rwpng_write_image_init_mem(mainprog_info *mainprog_ptr);
+
 int rwpng_write_image_whole(mainprog_info *mainprog_ptr);
 
 int rwpng_write_image_row(mainprog_info *mainprog_ptr);
@@ -0,0 +1,203 @@
+/* api_check.c - check the libpngnq interface of pngnq.h.
+**
+** Quantizes an image of a few colours, which must come back exactly, and a
+** gradient with each kind of dithering, checking the palette order and the
+** error, and with each palette order, which must not change the pixels.
+** Then has several threads quantize at once, each with its own
+** context, and compares their results with one done alone.
+** Exits with status 1 on any failure.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#include "pngnq.h"
+#include "gradient.h"
+
+#define N_THREADS 4
+
+static unsigned char gradient[WIDTH*HEIGHT*4];
+
+/* Checks that the entries that are not opaque come first */
+static int palette_ok(const pngnq_palette *pal, unsigned int max_colours)
+{
+  unsigned int i;
+
+  if (pal->count < 1 || pal->count > max_colours || pal->num_trans > pal->count)
+    return 0;
+  for (i = 0; i < pal->count; i++)
+    if ((pal->rgba[i][3] < 255) != (i < pal->num_trans))
+      return 0;
+  return 1;
+}
+
+static int check_exact(pngnq_context *ctx)
+{
+  static const unsigned char colours[5][4] = {
+    { 255, 0, 0, 255 }, { 0, 255, 0, 255 }, { 0, 0, 255, 128 },
+    { 10, 20, 30, 40 }, { 0, 0, 0, 0 }
+  };
+  unsigned char pic[WIDTH*HEIGHT*4], indices[WIDTH*HEIGHT];
+  pngnq_palette pal;
+  int i;
+
+  for (i = 0; i < WIDTH*HEIGHT; i++)
+    memcpy(pic + i*4, colours[(i / 7) % 5], 4);
+  if (pngnq_quantize(ctx, pic, WIDTH, HEIGHT, NULL, &pal, indices) != PNGNQ_OK ||
+      !palette_ok(&pal, 256) || pal.count != 5 || pal.num_trans != 3)
+    return 0;
+  for (i = 0; i < WIDTH*HEIGHT; i++)
+    if (indices[i] >= pal.count || memcmp(pal.rgba[indices[i]], pic + i*4, 4) != 0)
+      return 0;
+  return 1;
+}
+
+/* Returns the mean absolute error per channel, or -1 on failure. Anything
+   near that of a random palette, over 60, means the palette is wrong. */
+static double check_gradient(pngnq_context *ctx, int dither)
+{
+  unsigned char indices[WIDTH*HEIGHT];
+  pngnq_options opt;
+  pngnq_palette pal;
+  double error = 0;
+  int i, c;
+
+  pngnq_options_init(&opt);
+  opt.colours = 32;
+  opt.dither = dither;
+  if (pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, &opt, &pal, indices) != PNGNQ_OK ||
+      !palette_ok(&pal, 32))
+    return -1;
+  for (i = 0; i < WIDTH*HEIGHT; i++) {
+    if (indices[i] >= pal.count)
+      return -1;
+    for (c = 0; c < 4; c++)
+      error += abs(pal.rgba[indices[i]][c] - gradient[i*4+c]);
+  }
+  return error / (WIDTH*HEIGHT*4);
+}
+
+/* Checks that reordering the palette leaves every pixel its colour */
+static int check_orders(pngnq_context *ctx)
+{
+  static unsigned char plain[WIDTH*HEIGHT], indices[WIDTH*HEIGHT];
+  pngnq_options opt;
+  pngnq_palette plain_pal, pal;
+  int order, i;
+
+  pngnq_options_init(&opt);
+  opt.colours = 32;
+  if (pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, &opt, &plain_pal, plain) != PNGNQ_OK)
+    return 0;
+  for (order = PNGNQ_ORDER_LUMINANCE; order <= PNGNQ_ORDER_NEIGHBOURS; order++) {
+    opt.order = order;
+    if (pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, &opt, &pal, indices) != PNGNQ_OK ||
+        !palette_ok(&pal, 32) || pal.count != plain_pal.count)
+      return 0;
+    for (i = 0; i < WIDTH*HEIGHT; i++)
+      if (memcmp(pal.rgba[indices[i]], plain_pal.rgba[plain[i]], 4) != 0)
+        return 0;
+  }
+  return 1;
+}
+
+#if HAVE_PTHREAD_H
+typedef struct {
+  unsigned char indices[WIDTH*HEIGHT];
+  pngnq_palette pal;
+  int retval;
+} thread_result;
+
+static void *quantize_thread(void *arg)
+{
+  thread_result *res = (thread_result *)arg;
+  pngnq_context *ctx = pngnq_create();
+  pngnq_options opt;
+  int i;
+
+  pngnq_options_init(&opt);
+  opt.dither = PNGNQ_DITHER_FLOYD;
+  res->retval = ctx ? PNGNQ_OK : PNGNQ_ERR_MEMORY;
+  for (i = 0; i < 4 && res->retval == PNGNQ_OK; i++)
+    res->retval = pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, &opt, &res->pal, res->indices);
+  pngnq_destroy(ctx);
+  return NULL;
+}
+
+static int check_threads(void)
+{
+  static thread_result alone, results[N_THREADS];
+  pthread_t threads[N_THREADS];
+  int i, ok = 1;
+
+  quantize_thread(&alone);
+  for (i = 0; i < N_THREADS; i++)
+    if (pthread_create(&threads[i], NULL, quantize_thread, &results[i]) != 0)
+      return 0;
+  for (i = 0; i < N_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    ok = ok && results[i].retval == PNGNQ_OK &&
+      memcmp(&results[i].pal, &alone.pal, sizeof(alone.pal)) == 0 &&
+      memcmp(results[i].indices, alone.indices, sizeof(alone.indices)) == 0;
+  }
+  return alone.retval == PNGNQ_OK && ok;
+}
+#endif
+
+int main(void)
+{
+  static const char *names[] = { "none", "floyd", "ordered" };
+  pngnq_context *ctx;
+  pngnq_options opt;
+  pngnq_palette pal;
+  unsigned char index;
+  double error;
+  int dither, failed = 0;
+
+  make_gradient(gradient);
+
+  if ((ctx = pngnq_create()) == NULL)
+    return 2;
+  printf("libpngnq %s\n", pngnq_version());
+
+  if (!check_exact(ctx)) {
+    printf("image of 5 colours: not kept exactly\n");
+    failed = 1;
+  }
+
+  for (dither = PNGNQ_DITHER_NONE; dither <= PNGNQ_DITHER_ORDERED; dither++) {
+    error = check_gradient(ctx, dither);
+    printf("gradient to 32 colours, dither %s: mean error %.2f\n", names[dither], error);
+    if (error < 0 || error > 20)
+      failed = 1;
+  }
+
+  if (!check_orders(ctx)) {
+    printf("palette orders: pixels changed\n");
+    failed = 1;
+  }
+
+  pngnq_options_init(&opt);
+  opt.colours = 0;
+  if (pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, &opt, &pal, &index) != PNGNQ_ERR_ARGUMENT ||
+      pngnq_quantize(ctx, gradient, 0, HEIGHT, NULL, &pal, &index) != PNGNQ_ERR_ARGUMENT) {
+    printf("bad arguments accepted\n");
+    failed = 1;
+  }
+  pngnq_destroy(ctx);
+
+#if HAVE_PTHREAD_H
+  if (!check_threads()) {
+    printf("%d threads at once: results differ\n", N_THREADS);
+    failed = 1;
+  }
+#endif
+  return failed;
+}
@@ -0,0 +1,103 @@
+/* bigimage_check.c - check that learn() sees all of an image of more than
+** 4 GiB.
+**
+** The image is 6 GiB of address space: 4 GiB of black pixels followed by
+** 2 GiB of white ones. It is built from two small temporary files holding
+** one tile of each colour, mapped over and over, so it takes hardly any
+** memory. With 32 bit lengths only the first 2 GiB would be seen and the
+** palette would have no white in it.
+** Exits with status 1 if the palette misses either colour, and with 77
+** (skipped) where the address space cannot be had.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "neuquant32.h"
+
+#define TILE (1<<24)			/* bytes, 4M pixels */
+#define BLACK_TILES 256			/* 4 GiB */
+#define WHITE_TILES 128			/* 2 GiB */
+#define COLOURS 16
+
+/* Returns a temporary file holding one tile of the given grey */
+static FILE *make_tile(unsigned char grey)
+{
+  unsigned char *buf;
+  FILE *f;
+  int i;
+
+  if ((f = tmpfile()) == NULL || (buf = malloc(TILE)) == NULL)
+    return NULL;
+  for (i = 0; i < TILE; i += 4) {
+    buf[i] = buf[i+1] = buf[i+2] = grey;
+    buf[i+3] = 255;
+  }
+  if (fwrite(buf, 1, TILE, f) != TILE || fflush(f) != 0) {
+    fclose(f);
+    f = NULL;
+  }
+  free(buf);
+  return f;
+}
+
+/* Maps tile file f n times from address at on */
+static int map_tiles(unsigned char *at, FILE *f, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++, at += TILE)
+    if (mmap(at, TILE, PROT_READ, MAP_SHARED | MAP_FIXED, fileno(f), 0) == MAP_FAILED)
+      return 0;
+  return 1;
+}
+
+int main(void)
+{
+  size_t len = (size_t)TILE * (BLACK_TILES + WHITE_TILES);
+  unsigned char map[MAXNETSIZE*4];
+  unsigned char *pic;
+  FILE *black, *white;
+  nq_context *nq;
+  int i, have_black = 0, have_white = 0;
+
+  if (sizeof(size_t) < 8) {
+    printf("bigimage_check: needs a 64 bit address space, skipped\n");
+    return 77;
+  }
+
+  black = make_tile(0);
+  white = make_tile(255);
+  pic = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!black || !white || pic == MAP_FAILED ||
+      !map_tiles(pic, black, BLACK_TILES) ||
+      !map_tiles(pic + (size_t)TILE*BLACK_TILES, white, WHITE_TILES)) {
+    printf("bigimage_check: cannot map a %lu byte image, skipped\n", (unsigned long)len);
+    return 77;
+  }
+
+  if ((nq = nq_create()) == NULL)
+    return 2;
+  initnet(nq, pic, len, COLOURS, 1.0);
+  learn(nq, 1, 0);
+  inxbuild(nq);
+  getcolormap(nq, map);
+
+  for (i = 0; i < COLOURS; i++) {
+    if (map[i*4] < 8 && map[i*4+1] < 8 && map[i*4+2] < 8)
+      have_black = 1;
+    if (map[i*4] > 247 && map[i*4+1] > 247 && map[i*4+2] > 247)
+      have_white = 1;
+  }
+  printf("%lu byte image: palette %s black, %s white\n", (unsigned long)len,
+         have_black ? "has" : "lacks", have_white ? "has" : "lacks");
+
+  nq_destroy(nq);
+  munmap(pic, len);
+  fclose(black);
+  fclose(white);
+  return have_black && have_white ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/* cli_check.c - check that the pngnq program and pngnq_quantize() agree.
+**
+** pngnq links the quantizer directly rather than through libpngnq, as it
+** also handles what the library does not take: gray and 16-bit input,
+** streaming, and writing rows as they are mapped. Both run the same code
+** on an RGBA image, though, so for each dither and palette order this
+** writes a gradient as a PNG file, has ./pngnq quantize it, and checks
+** that its palette and pixels are those pngnq_quantize() gives.
+** Exits with status 1 on any failure.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "png.h"
+#include "pngnq.h"
+#include "gradient.h"
+
+#define COLOURS 32
+#define IN_FILE "cli_check.png"
+#define OUT_FILE "cli_check-cli.png"
+
+static unsigned char gradient[WIDTH*HEIGHT*4];
+
+static int write_png(const char *name, const unsigned char *rgba)
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  FILE *f;
+  int y;
+
+  if ((f = fopen(name, "wb")) == NULL)
+    return 0;
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : NULL);
+    fclose(f);
+    return 0;
+  }
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (y = 0; y < HEIGHT; y++)
+    png_write_row(png_ptr, (png_bytep)rgba + y*WIDTH*4);
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return fclose(f) == 0;
+}
+
+/* Reads an 8-bit palette image of WIDTH x HEIGHT into pal and indices */
+static int read_png(const char *name, pngnq_palette *pal, unsigned char *indices)
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  png_colorp plte;
+  png_bytep trns = NULL;
+  png_color_16p trans_values;
+  int n_plte, n_trns = 0, ok = 0, y, i;
+  FILE *f;
+
+  if ((f = fopen(name, "rb")) == NULL)
+    return 0;
+  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+    fclose(f);
+    return 0;
+  }
+  png_init_io(png_ptr, f);
+  png_read_info(png_ptr, info_ptr);
+  if (png_get_image_width(png_ptr, info_ptr) == WIDTH &&
+      png_get_image_height(png_ptr, info_ptr) == HEIGHT &&
+      png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE &&
+      png_get_bit_depth(png_ptr, info_ptr) == 8 &&
+      png_get_PLTE(png_ptr, info_ptr, &plte, &n_plte)) {
+    png_get_tRNS(png_ptr, info_ptr, &trns, &n_trns, &trans_values);
+    memset(pal, 0, sizeof(*pal));
+    pal->count = n_plte;
+    pal->num_trans = n_trns;
+    for (i = 0; i < n_plte; i++) {
+      pal->rgba[i][0] = plte[i].red;
+      pal->rgba[i][1] = plte[i].green;
+      pal->rgba[i][2] = plte[i].blue;
+      pal->rgba[i][3] = i < n_trns ? trns[i] : 255;
+    }
+    for (y = 0; y < HEIGHT; y++)
+      png_read_row(png_ptr, indices + y*WIDTH, NULL);
+    ok = 1;
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  fclose(f);
+  return ok;
+}
+
+/* Quantizes the gradient both ways; args are the pngnq options for opt */
+static int check_same(pngnq_context *ctx, const pngnq_options *opt, const char *args)
+{
+  unsigned char cli_indices[WIDTH*HEIGHT], lib_indices[WIDTH*HEIGHT];
+  pngnq_palette cli_pal, lib_pal;
+  char command[256];
+  unsigned int i;
+
+  snprintf(command, sizeof(command), "./pngnq -f -e -cli.png %s " IN_FILE, args);
+  remove(OUT_FILE);
+  if (system(command) != 0 || !read_png(OUT_FILE, &cli_pal, cli_indices)) {
+    printf("%s: no output\n", command);
+    return 0;
+  }
+  if (pngnq_quantize(ctx, gradient, WIDTH, HEIGHT, opt, &lib_pal, lib_indices) != PNGNQ_OK) {
+    printf("%s: pngnq_quantize() failed\n", command);
+    return 0;
+  }
+  if (cli_pal.count != lib_pal.count || cli_pal.num_trans != lib_pal.num_trans) {
+    printf("%s: %u colours, %u not opaque; pngnq_quantize() %u, %u\n", command,
+           cli_pal.count, cli_pal.num_trans, lib_pal.count, lib_pal.num_trans);
+    return 0;
+  }
+  for (i = 0; i < lib_pal.count; i++)
+    if (memcmp(cli_pal.rgba[i], lib_pal.rgba[i], 4) != 0) {
+      printf("%s: palette entry %u differs\n", command, i);
+      return 0;
+    }
+  if (memcmp(cli_indices, lib_indices, sizeof(lib_indices)) != 0) {
+    printf("%s: pixels differ\n", command);
+    return 0;
+  }
+  printf("%s: same\n", command);
+  return 1;
+}
+
+int main(void)
+{
+  static const struct {
+    const char *args;
+    int dither;
+    int order;
+  } runs[] = {
+    { "-Q n", PNGNQ_DITHER_NONE, PNGNQ_ORDER_NONE },
+    { "-Q f", PNGNQ_DITHER_FLOYD, PNGNQ_ORDER_NONE },
+    { "-Q o", PNGNQ_DITHER_ORDERED, PNGNQ_ORDER_NONE },
+    { "-Q f -P l", PNGNQ_DITHER_FLOYD, PNGNQ_ORDER_LUMINANCE },
+    { "-Q f -P a", PNGNQ_DITHER_FLOYD, PNGNQ_ORDER_NEIGHBOURS },
+  };
+  pngnq_context *ctx;
+  pngnq_options opt;
+  char args[64];
+  int i, failed = 0;
+
+  make_gradient(gradient);
+
+  if (!write_png(IN_FILE, gradient)) {
+    printf("cannot write " IN_FILE "\n");
+    return 2;
+  }
+  if ((ctx = pngnq_create()) == NULL)
+    return 2;
+
+  /* pngnq takes the gamma from the file, which has none */
+  for (i = 0; i < (int)(sizeof(runs)/sizeof(runs[0])); i++) {
+    pngnq_options_init(&opt);
+    opt.colours = COLOURS;
+    opt.dither = runs[i].dither;
+    opt.order = runs[i].order;
+    snprintf(args, sizeof(args), "-n %d -g %g %s", COLOURS, opt.gamma, runs[i].args);
+    if (!check_same(ctx, &opt, args))
+      failed = 1;
+  }
+
+  pngnq_destroy(ctx);
+  remove(IN_FILE);
+  remove(OUT_FILE);
+  return failed;
+}
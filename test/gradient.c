@@ -0,0 +1,17 @@
+/* gradient.c - the test image shared by api_check and cli_check. */
+
+#include "gradient.h"
+
+void make_gradient(unsigned char *rgba)
+{
+  int x, y;
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++) {
+      unsigned char *p = rgba + (y*WIDTH + x)*4;
+      p[0] = x;
+      p[1] = y*2;
+      p[2] = 255 - x;
+      p[3] = y < HEIGHT/4 ? y*8 : 255;
+    }
+}
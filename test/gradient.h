@@ -0,0 +1,10 @@
+/* gradient.h - the test image shared by api_check and cli_check, so that
+** the two quantize the same pixels.
+*/
+
+#define WIDTH 256
+#define HEIGHT 128
+
+/* Fills rgba, WIDTH*HEIGHT*4 bytes, with a gradient whose top quarter
+   fades in from transparent */
+void make_gradient(unsigned char *rgba);
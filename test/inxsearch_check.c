@@ -0,0 +1,147 @@
+/* inxsearch_check.c - check the k-d tree and exhaustive SIMD colour
+** searches against slowinxsearch() and compare the speed of the search
+** methods.
+**
+** Trains palettes on a few synthetic images, including ones with little
+** spread in green, then looks up the image's own pixels, a grid over the
+** whole colour space and random colours.
+** Exits with status 1 if an exact search ever disagrees with slowinxsearch().
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "neuquant32.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+#define N_RANDOM 200000
+
+static double seconds(void)
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* Fills pic with RGBA test pattern number kind */
+static void make_image(unsigned char *pic, int kind)
+{
+  int x, y;
+  unsigned char *p = pic;
+
+  srand(kind);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++, p += 4) {
+      switch (kind) {
+      case 0:			/* noise */
+        p[0] = rand(); p[1] = rand(); p[2] = rand(); p[3] = rand();
+        break;
+      case 1:			/* smooth, opaque */
+        p[0] = x; p[1] = y; p[2] = (x+y)/2; p[3] = 255;
+        break;
+      case 2:			/* a single green value */
+        p[0] = x; p[1] = 128; p[2] = y; p[3] = 255;
+        break;
+      default:			/* translucent, little green */
+        p[0] = rand(); p[1] = 100 + (rand() & 7); p[2] = x; p[3] = y;
+        break;
+      }
+    }
+  }
+}
+
+/* Looks up all n colours in q (RGBA) with inxsearch() using the given
+   method, or with slowinxsearch() if method is -1. Returns the time taken. */
+static double lookup_all(nq_context *nq, int method, const unsigned char *q, long n, unsigned int *result)
+{
+  double start = seconds();
+  long i;
+
+  if (method >= 0)
+    nq_set_search(nq, method);
+  for (i = 0; i < n; i++, q += 4)
+    result[i] = method < 0 ? slowinxsearch(nq, q[3], q[2], q[1], q[0])
+                           : inxsearch(nq, q[3], q[2], q[1], q[0]);
+  return seconds() - start;
+}
+
+int main(void)
+{
+  long n_queries = WIDTH*HEIGHT + 18*18*18*18 + N_RANDOM;
+  unsigned char *pic = malloc(WIDTH*HEIGHT*4);
+  unsigned char *queries = malloc(n_queries*4);
+  unsigned int *slow = malloc(n_queries*sizeof(unsigned int));
+  unsigned int *net = malloc(n_queries*sizeof(unsigned int));
+  unsigned int *kd = malloc(n_queries*sizeof(unsigned int));
+  unsigned int *brute = malloc(n_queries*sizeof(unsigned int));
+  int kind, colours, r, g, b, a;
+  long i, failures = 0;
+
+  if (!pic || !queries || !slow || !net || !kd || !brute)
+    return 2;
+
+  for (kind = 0; kind < 4; kind++) {
+    for (colours = 16; colours <= MAXNETSIZE; colours *= 4) {
+      nq_context *nq = nq_create();
+      double t_slow, t_net, t_kd, t_brute;
+      long netindex_misses = 0;
+      unsigned char *q = queries;
+
+      make_image(pic, kind);
+      initnet(nq, pic, WIDTH*HEIGHT*4, colours, 1.0/2.2);
+      learn(nq, 1, 0);
+      inxbuild(nq);
+
+      /* the image itself, a grid over the whole colour space, random colours */
+      memcpy(q, pic, WIDTH*HEIGHT*4);
+      q += WIDTH*HEIGHT*4;
+      for (r = 0; r < 256; r += 15)
+        for (g = 0; g < 256; g += 15)
+          for (b = 0; b < 256; b += 15)
+            for (a = 0; a < 256; a += 15, q += 4) {
+              q[0] = r; q[1] = g; q[2] = b; q[3] = a;
+            }
+      for (i = 0; i < N_RANDOM; i++, q += 4) {
+        q[0] = rand(); q[1] = rand(); q[2] = rand(); q[3] = rand();
+      }
+
+      /* only the image pixels are timed, as in a real remap */
+      t_slow = lookup_all(nq, -1, queries, WIDTH*HEIGHT, slow);
+      t_net = lookup_all(nq, NQ_SEARCH_NETINDEX, queries, WIDTH*HEIGHT, net);
+      t_kd = lookup_all(nq, NQ_SEARCH_KDTREE, queries, WIDTH*HEIGHT, kd);
+      t_brute = lookup_all(nq, NQ_SEARCH_BRUTE, queries, WIDTH*HEIGHT, brute);
+      i = WIDTH*HEIGHT;
+      lookup_all(nq, -1, queries+i*4, n_queries-i, slow+i);
+      lookup_all(nq, NQ_SEARCH_NETINDEX, queries+i*4, n_queries-i, net+i);
+      lookup_all(nq, NQ_SEARCH_KDTREE, queries+i*4, n_queries-i, kd+i);
+      lookup_all(nq, NQ_SEARCH_BRUTE, queries+i*4, n_queries-i, brute+i);
+
+      for (i = 0, q = queries; i < n_queries; i++, q += 4) {
+        if (net[i] != slow[i])
+          netindex_misses++;
+        if (kd[i] != slow[i] || brute[i] != slow[i]) {
+          if (failures++ < 10)
+            fprintf(stderr, "  colour %d,%d,%d,%d: k-d tree gives %u, exhaustive %u, slowinxsearch %u\n",
+                    q[0], q[1], q[2], q[3], kd[i], brute[i], slow[i]);
+        }
+      }
+
+      printf("image %d, %3d colours: slowinxsearch %.3fs, netindex %.3fs (%ld inexact), k-d tree %.3fs, exhaustive %.3fs\n",
+             kind, colours, t_slow, t_net, netindex_misses, t_kd, t_brute);
+      nq_destroy(nq);
+    }
+  }
+
+  free(pic);
+  free(queries);
+  free(slow);
+  free(net);
+  free(kd);
+  free(brute);
+  if (failures) {
+    printf("%ld lookups disagree with slowinxsearch()\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Compare speed and quality of the training precisions (-t option)
+
+IMAGES=$(ls ./images/[!x]*[!nq8].png)
+
+for PRECISION in d f i
+    do
+        echo
+        echo "*********************************************"
+        echo Training precision ${PRECISION}
+        time pngnq -f -t ${PRECISION} -e -${PRECISION}.png ${IMAGES}
+
+        for IMAGE in ${IMAGES}
+            do
+                pngcomp ${IMAGE} ${IMAGE/.png/-${PRECISION}.png}
+            done | awk '/Mean pixel color error/ { sum += $NF; n++ }
+                END { if (n) printf "Mean pixel error over %d images: %f\n", n, sum/n }'
+        echo "*********************************************"
+    done
+
+rm images/*-[dfi].png
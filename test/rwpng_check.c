@@ -0,0 +1,147 @@
+/* rwpng_check.c - check reading and writing PNG files in memory.
+**
+** Writes a palette image with rwpng_write_image_init_mem() and a row at a
+** time, reads it back with rwpng_read_image_mem(), writes the pixels read
+** out again the same way and reads that back too. Both reads must give
+** the colours of the palette image. Then reads the second file cut short
+** at several lengths, which must fail with 25, or 21 for a signature cut
+** short.
+** Exits with status 1 on any failure.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "png.h"
+#include "rwpng.h"
+
+#define WIDTH 61
+#define HEIGHT 37
+#define COLOURS 20
+
+static unsigned char palette[COLOURS][4];
+static unsigned char indices[WIDTH*HEIGHT];
+
+/* Writes the image of the given indices into palette into out->out_buf.
+   Returns 0 or an rwpng error code. */
+static int write_mem(mainprog_info *out, const unsigned char *pixels)
+{
+  unsigned char row[WIDTH];
+  int i, y;
+
+  memset(out, 0, sizeof(*out));
+  out->width = WIDTH;
+  out->height = HEIGHT;
+  out->sample_depth = 8;
+  out->num_palette = COLOURS;
+  out->num_trans = 0;
+  for (i = 0; i < COLOURS; i++) {
+    out->palette[i].red = palette[i][0];
+    out->palette[i].green = palette[i][1];
+    out->palette[i].blue = palette[i][2];
+    out->trans[i] = palette[i][3];
+    if (palette[i][3] < 255)
+      out->num_trans = i + 1;
+  }
+  if (rwpng_write_image_init_mem(out) != 0)
+    return out->retval;
+  out->indexed_data = row;
+  for (y = 0; y < HEIGHT; y++) {
+    memcpy(row, pixels + y*WIDTH, WIDTH);
+    if (rwpng_write_image_row(out) != 0)
+      return out->retval;
+  }
+  return rwpng_write_image_finish(out);
+}
+
+/* Reads size bytes of PNG file at buf as RGBA into in. Returns 0 or an
+   rwpng error code. */
+static int read_mem(mainprog_info *in, const unsigned char *buf, size_t size)
+{
+  memset(in, 0, sizeof(*in));
+  return rwpng_read_image_mem(buf, size, in);
+}
+
+/* Whether in holds the RGBA pixels of indices */
+static int same_pixels(const mainprog_info *in)
+{
+  int i;
+
+  if (in->width != WIDTH || in->height != HEIGHT || in->channels != 4)
+    return 0;
+  for (i = 0; i < WIDTH*HEIGHT; i++)
+    if (memcmp(in->rgba_data + i*4, palette[indices[i]], 4) != 0)
+      return 0;
+  return 1;
+}
+
+static void free_image(mainprog_info *in)
+{
+  free(in->rgba_data);
+  free(in->row_pointers);
+}
+
+int main(void)
+{
+  mainprog_info first, second, in;
+  unsigned char again[WIDTH*HEIGHT];
+  size_t cut[4];
+  int i, j, retval, failed = 0;
+
+  /* the entries that are not opaque come first, as pngnq writes them */
+  for (i = 0; i < COLOURS; i++) {
+    palette[i][0] = i*13;
+    palette[i][1] = 255 - i*7;
+    palette[i][2] = (i*91) & 255;
+    palette[i][3] = i < 4 ? i*60 : 255;
+  }
+  for (i = 0; i < WIDTH*HEIGHT; i++)
+    indices[i] = (i*7 + i/WIDTH) % COLOURS;
+
+  if ((retval = write_mem(&first, indices)) != 0) {
+    printf("writing to memory: error %d\n", retval);
+    return 1;
+  }
+  if ((retval = read_mem(&in, first.out_buf, first.out_size)) != 0 || !same_pixels(&in)) {
+    printf("reading %lu bytes from memory: error %d\n", (unsigned long)first.out_size, retval);
+    return 1;
+  }
+
+  /* the pixels read, back to indices, out again */
+  for (i = 0; i < WIDTH*HEIGHT; i++) {
+    for (j = 0; j < COLOURS && memcmp(in.rgba_data + i*4, palette[j], 4) != 0; j++);
+    again[i] = j;
+  }
+  free_image(&in);
+  if ((retval = write_mem(&second, again)) != 0) {
+    printf("writing again to memory: error %d\n", retval);
+    return 1;
+  }
+  if ((retval = read_mem(&in, second.out_buf, second.out_size)) != 0 || !same_pixels(&in)) {
+    printf("reading again %lu bytes from memory: error %d\n", (unsigned long)second.out_size, retval);
+    failed = 1;
+  }
+  free_image(&in);
+  printf("round trip through %lu and %lu bytes\n",
+         (unsigned long)first.out_size, (unsigned long)second.out_size);
+
+  /* in the signature, the header, the image data, and just before IEND */
+  cut[0] = 5;
+  cut[1] = 20;
+  cut[2] = second.out_size / 2;
+  cut[3] = second.out_size - 13;
+  for (i = 0; i < 4; i++) {
+    retval = read_mem(&in, second.out_buf, cut[i]);
+    free_image(&in);
+    if (retval != (i == 0 ? 21 : 25)) {
+      printf("file cut short at %lu bytes: error %d\n", (unsigned long)cut[i], retval);
+      failed = 1;
+    }
+  }
+
+  free(first.out_buf);
+  free(second.out_buf);
+  return failed;
+}